@@ -1,26 +1,57 @@
 #include <string.h>
-#include <libgen.h>
+#include <errno.h>
+#include <time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fts.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <gmime/gmime.h>
-#include "parson/parson.h"
 #include <gumbo.h>
 #include "jmime.h"
 #include "jxapian.h"
 
+// AVX2 is picked at runtime, whatever the compiler flags
+#if defined(__x86_64__) && defined(__GNUC__)
+#define JMIME_AVX2_DISPATCH
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define UTF8_CHARSET "UTF-8"
 #define RECURSION_LIMIT 30
 #define CITATION_COLOUR 4537548
 #define MAX_PREVIEW_LENGTH 512
 
+#define MAX_HEADER_SIZE (1024 * 1024)
+#define HEADER_READ_SIZE 8192
+
 #define MAX_CID_SIZE 65536
 #define MIN_DATA_URI_IMAGE "data:image/gif;base64,R0lGODlhAQABAAAAACwAAAAAAQABAAA="
 
 #define INDEX_DIRECTORY_NAME ".jmimeindex"
+#define INDEX_COMMIT_DOCUMENTS 1000
+#define INDEX_COMMIT_BYTES (32 * 1024 * 1024)
+#define INDEX_JOBS 1
+#define INDEX_QUEUED_PER_JOB 4
+
+#define CACHE_DIRECTORY_NAME ".jmimecache"
+#define CACHE_FORMAT_VERSION 1
+#define CACHE_MAX_SIZE (256 * 1024 * 1024)
+#define CACHE_EVICT_EVERY 32
+#define CACHE_TOUCH_INTERVAL 60
+
+#define LIMIT_PARTS 1000
+#define LIMIT_DECODED_BYTES (256 * 1024 * 1024)
+#define LIMIT_HTML_BYTES (16 * 1024 * 1024)
+#define LIMIT_DOM_NODES 1000000
+#define LIMIT_MILLISECONDS 10000
+#define LIMIT_CLOCK_NODES 1024
 
 
 /*
@@ -69,10 +100,11 @@ typedef struct MessageBody {
  */
 
 typedef struct MessageAttachment {
-  guint part_id;
-  gchar *content_type;
-  gchar *filename;
-  guint size;
+  guint    part_id;
+  gchar    *content_type;
+  gchar    *filename;
+  guint    size;
+  gboolean undecoded;  // beyond the decoding budget, so of unknown size
 } MessageAttachment;
 
 
@@ -85,6 +117,22 @@ typedef struct MessageAttachment {
 typedef GPtrArray MessageAttachmentsList;
 
 
+/*
+ * ConvertMode
+ *
+ * How much of a message is converted into MessageData: only the headers,
+ * everything as presented to the user (sanitized HTML bodies with previews),
+ * or everything as needed for indexing (bodies reduced to their complete
+ * visible text, without sanitizing or inlining).
+ *
+ */
+typedef enum ConvertMode {
+  CONVERT_HEADERS,
+  CONVERT_FULL,
+  CONVERT_INDEXING
+} ConvertMode;
+
+
 /*
  * MessageData
  *
@@ -107,9 +155,132 @@ typedef struct MessageData {
   MessageBody            *text;
   MessageBody            *html;
   MessageAttachmentsList *attachments;
+  guint                  fields;     // JSON_FIELD_* members to convert and write
+  gboolean               truncated;  // whether the conversion ran out of a budget
 } MessageData;
 
 
+/*
+ * JSON fields
+ *
+ * The members of MessageData which a caller asked for. The text and html
+ * bodies each have their own set of JSON_BODY_* bits.
+ */
+#define JSON_FIELD_FROM        (1 << 0)
+#define JSON_FIELD_TO          (1 << 1)
+#define JSON_FIELD_REPLY_TO    (1 << 2)
+#define JSON_FIELD_CC          (1 << 3)
+#define JSON_FIELD_BCC         (1 << 4)
+#define JSON_FIELD_MESSAGE_ID  (1 << 5)
+#define JSON_FIELD_SUBJECT     (1 << 6)
+#define JSON_FIELD_DATE        (1 << 7)
+#define JSON_FIELD_IN_REPLY_TO (1 << 8)
+#define JSON_FIELD_REFERENCES  (1 << 9)
+#define JSON_FIELD_ATTACHMENTS (1 << 10)
+#define JSON_FIELD_TEXT(body)  ((body) << 11)
+#define JSON_FIELD_HTML(body)  ((body) << 15)
+#define JSON_FIELDS_ALL        ((1 << 19) - 1)
+
+#define JSON_BODY_TYPE    (1 << 0)
+#define JSON_BODY_CONTENT (1 << 1)
+#define JSON_BODY_PREVIEW (1 << 2)
+#define JSON_BODY_SIZE    (1 << 3)
+#define JSON_BODY_ALL     0xF
+
+#define JSON_TEXT_BODY(fields) (((fields) >> 11) & JSON_BODY_ALL)
+#define JSON_HTML_BODY(fields) (((fields) >> 15) & JSON_BODY_ALL)
+
+
+/*
+ * ConversionBudget
+ *
+ * What is left of the JMimeLimits while converting one message. Once any
+ * budget runs out, truncated is set and the conversion does less from then
+ * on. Without limits (NULL) everything is allowed.
+ */
+typedef struct ConversionBudget {
+  const JMimeLimits *limits;
+  guint             parts;
+  gsize             decoded_bytes;
+  guint             dom_nodes;
+  gint64            deadline;   // in monotonic microseconds, or 0
+  gboolean          truncated;
+} ConversionBudget;
+
+
+static void conversion_budget_init(ConversionBudget *budget, const JMimeLimits *limits) {
+  budget->limits        = limits;
+  budget->parts         = 0;
+  budget->decoded_bytes = 0;
+  budget->dom_nodes     = 0;
+  budget->deadline      = 0;
+  budget->truncated     = FALSE;
+
+  if (limits && limits->max_milliseconds)
+    budget->deadline = g_get_monotonic_time() + (gint64) limits->max_milliseconds * 1000;
+}
+
+
+static gboolean budget_out_of_time(ConversionBudget *budget) {
+  if (!budget || !budget->deadline)
+    return FALSE;
+
+  if (g_get_monotonic_time() <= budget->deadline)
+    return FALSE;
+
+  budget->truncated = TRUE;
+  return TRUE;
+}
+
+
+static gboolean budget_take_part(ConversionBudget *budget) {
+  if (!budget || !budget->limits)
+    return TRUE;
+
+  if (budget_out_of_time(budget) || (budget->limits->max_parts && budget->parts >= budget->limits->max_parts)) {
+    budget->truncated = TRUE;
+    return FALSE;
+  }
+
+  budget->parts++;
+  return TRUE;
+}
+
+
+// The bytes which may still be decoded
+static gsize budget_decodable_bytes(ConversionBudget *budget) {
+  if (!budget || !budget->limits || !budget->limits->max_decoded_bytes)
+    return G_MAXSIZE;
+
+  if (budget->decoded_bytes >= budget->limits->max_decoded_bytes)
+    return 0;
+  return budget->limits->max_decoded_bytes - budget->decoded_bytes;
+}
+
+
+static void budget_count_decoded(ConversionBudget *budget, gsize decoded_bytes) {
+  if (budget)
+    budget->decoded_bytes += decoded_bytes;
+}
+
+
+// Counts a DOM node, looking at the clock every so often
+static gboolean budget_take_node(ConversionBudget *budget) {
+  if (!budget || !budget->limits)
+    return TRUE;
+
+  if (budget->limits->max_dom_nodes && budget->dom_nodes >= budget->limits->max_dom_nodes) {
+    budget->truncated = TRUE;
+    return FALSE;
+  }
+
+  if (!(++budget->dom_nodes % LIMIT_CLOCK_NODES) && budget_out_of_time(budget))
+    return FALSE;
+
+  return TRUE;
+}
+
+
 /*
  * Utils
  */
@@ -122,28 +293,14 @@ static gboolean gc_contains_c(const gchar *str, const gchar c) {
 }
 
 // The stripping functions from glib do not remove tabs, newlines etc.,
-// so we define our owns that remove all whitespace.
-static gchar *gc_lstrip(const gchar* text) {
-  GRegex *regex = g_regex_new ("\\A\\s+", 0, 0, NULL);
-  gchar *stripped = g_regex_replace_literal(regex, text, -1, 0, "", 0, NULL);
-  g_regex_unref(regex);
-  return stripped;
-}
-
-
-static gchar *gc_rstrip(const gchar* text) {
-  GRegex *regex = g_regex_new ("\\s+$", 0, 0, NULL);
-  gchar *stripped = g_regex_replace_literal(regex, text, -1, 0, "", 0, NULL);
-  g_regex_unref(regex);
-  return stripped;
-}
-
-
-static gchar *gc_strip(const gchar *text) {
-  gchar *lstripped = gc_lstrip(text);
-  gchar *stripped = gc_rstrip(lstripped);
-  g_free(lstripped);
-  return stripped;
+// so we define our owns that remove all whitespace. They only move the
+// bounds of the text, without copying it.
+static void gc_strip_bounds(const gchar **start, const gchar **end) {
+  while (*start < *end && g_ascii_isspace(**start))
+    (*start)++;
+
+  while (*end > *start && g_ascii_isspace(*(*end - 1)))
+    (*end)--;
 }
 
 static gchar *strip_trailing_slashes(const gchar* path) {
@@ -156,43 +313,150 @@ static gchar *strip_trailing_slashes(const gchar* path) {
 
 
 
-static GString *gstr_strip(GString *text) {
-  gchar *stripped_str = gc_strip(text->str);
-  g_string_assign(text, stripped_str);
-  g_free(stripped_str);
+/*
+ * Strips the whitespace around the text written since start, in place.
+ */
+static GString *gstr_strip_from(GString *text, gsize start) {
+  const gchar *stripped_start = text->str + start;
+  const gchar *stripped_end   = text->str + text->len;
+  gc_strip_bounds(&stripped_start, &stripped_end);
+
+  g_string_truncate(text, stripped_end - text->str);
+  if (stripped_start > text->str + start)
+    g_string_erase(text, start, stripped_start - (text->str + start));
+
   return text;
 }
 
 
-static GString *gstr_replace_all(GString *text, const gchar* old_str, const gchar *new_str) {
-  gchar *escaped_s1 = g_regex_escape_string (old_str, -1);
-  GRegex *regex = g_regex_new (escaped_s1, 0, 0, NULL);
-  gchar *new_string =  g_regex_replace_literal(regex, text->str, -1, 0, new_str, 0, NULL);
-  g_regex_unref(regex);
-  g_free(escaped_s1);
-  g_string_assign(text, new_string);
-  g_free(new_string);
-  return text;
+static GString *gstr_strip(GString *text) {
+  return gstr_strip_from(text, 0);
 }
 
 
-static GString *gstr_substitute_xml_entities_into_text(const gchar *text) {
-  GString *result = g_string_new(text);
-  gstr_replace_all(result, "&", "&amp;"); // replacing of & must come first
-  gstr_replace_all(result, "<", "&lt;");
-  gstr_replace_all(result, ">", "&gt;");
-  return result;
+/*
+ * Truncates the text to at most len bytes, without splitting a UTF-8
+ * character: the cut moves back to the start of the character at len.
+ */
+static GString *gstr_truncate_utf8(GString *text, gsize len) {
+  if (text->len <= len)
+    return text;
+
+  while (len > 0 && (text->str[len] & 0xC0) == 0x80)
+    len--;
+
+  return g_string_truncate(text, len);
+}
+
+
+/*
+ * Length of the leading part of the text that needs no XML escaping: up to
+ * the first '&', '<', '>' or the given quote. On x86-64 SSE2 tests 16 bytes
+ * per step, and AVX2 32 bytes where the CPU supports it (span_use_avx2, as
+ * detected by jmime_init); the kernels continue from offset i.
+ */
+static gboolean span_use_avx2 = FALSE;
+
+
+static gsize gc_unescaped_span_scalar(const gchar *text, gsize i, gsize len, gchar quote) {
+  for (; i < len; i++) {
+    gchar c = text[i];
+    if (c == '&' || c == '<' || c == '>' || c == quote)
+      return i;
+  }
+  return len;
 }
 
 
-static GString *gstr_substitute_xml_entities_into_attributes(const gchar quote, const gchar *text) {
-  GString *result = gstr_substitute_xml_entities_into_text(text);
-  if (quote == '"') {
-    gstr_replace_all(result, "\"", "&quot;");
-  } else if (quote == '\'') {
-    gstr_replace_all(result, "'", "&apos;");
+static gsize gc_unescaped_span_sse2(const gchar *text, gsize i, gsize len, gchar quote) {
+#if defined(__SSE2__)
+  const __m128i amp16   = _mm_set1_epi8('&');
+  const __m128i lt16    = _mm_set1_epi8('<');
+  const __m128i gt16    = _mm_set1_epi8('>');
+  const __m128i quote16 = _mm_set1_epi8(quote);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (text + i));
+    __m128i hits  = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, amp16), _mm_cmpeq_epi8(chunk, lt16)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(chunk, gt16),  _mm_cmpeq_epi8(chunk, quote16)));
+    guint32 mask = (guint32) _mm_movemask_epi8(hits);
+    if (mask)
+      return i + g_bit_nth_lsf(mask, -1);
   }
-  return result;
+#endif
+
+  return gc_unescaped_span_scalar(text, i, len, quote);
+}
+
+
+#if defined(JMIME_AVX2_DISPATCH)
+__attribute__((target("avx2")))
+static gsize gc_unescaped_span_avx2(const gchar *text, gsize i, gsize len, gchar quote) {
+  const __m256i amp32   = _mm256_set1_epi8('&');
+  const __m256i lt32    = _mm256_set1_epi8('<');
+  const __m256i gt32    = _mm256_set1_epi8('>');
+  const __m256i quote32 = _mm256_set1_epi8(quote);
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *) (text + i));
+    __m256i hits  = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, amp32), _mm256_cmpeq_epi8(chunk, lt32)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, gt32),  _mm256_cmpeq_epi8(chunk, quote32)));
+    guint32 mask = (guint32) _mm256_movemask_epi8(hits);
+    if (mask)
+      return i + g_bit_nth_lsf(mask, -1);
+  }
+
+  return gc_unescaped_span_sse2(text, i, len, quote);
+}
+#endif
+
+
+static void detect_span_kernel(void) {
+#if defined(JMIME_AVX2_DISPATCH)
+  __builtin_cpu_init();
+  span_use_avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+
+static gsize gc_unescaped_span(const gchar *text, gsize len, gchar quote) {
+  if (quote != '"' && quote != '\'')
+    quote = '&';
+
+#if defined(JMIME_AVX2_DISPATCH)
+  if (span_use_avx2)
+    return gc_unescaped_span_avx2(text, 0, len, quote);
+#endif
+
+  return gc_unescaped_span_sse2(text, 0, len, quote);
+}
+
+
+/*
+ * Appends the text with XML entities substituted: '&', '<' and '>', and
+ * within attributes the quote they are enclosed in.
+ */
+static GString *gstr_append_xml_escaped(GString *output, const gchar *text, gsize len, gchar quote) {
+  const gchar *end = text + len;
+
+  while (text < end) {
+    gsize span = gc_unescaped_span(text, end - text, quote);
+    g_string_append_len(output, text, span);
+    text += span;
+
+    if (text == end)
+      break;
+
+    switch (*text) {
+      case '&':  g_string_append(output, "&amp;");  break;
+      case '<':  g_string_append(output, "&lt;");   break;
+      case '>':  g_string_append(output, "&gt;");   break;
+      case '"':  g_string_append(output, "&quot;"); break;
+      case '\'': g_string_append(output, "&apos;"); break;
+    }
+    text++;
+  }
+  return output;
 }
 
 
@@ -280,6 +544,8 @@ static MessageAttachment *new_message_attachment(guint part_id) {
   att->part_id = part_id;
   att->content_type = NULL;
   att->filename = NULL;
+  att->size = 0;
+  att->undecoded = FALSE;
   return att;
 }
 
@@ -332,6 +598,8 @@ static MessageData *new_message_data(void) {
   mdata->text = NULL;
   mdata->html = NULL;
   mdata->attachments = NULL;
+  mdata->fields = JSON_FIELDS_ALL;
+  mdata->truncated = FALSE;
   return mdata;
 }
 
@@ -387,12 +655,16 @@ static void free_message_data(MessageData *mdata) {
  * CollectedPart
  */
 typedef struct CollectedPart {
-  guint      part_id;        // the depth within the message where this part is located
-  gchar      *content_type;  // content type (text/html, text/plan etc.)
-  GByteArray *content;       // content data
-  gchar      *content_id;    // for inline content
-  gchar      *filename;      // for attachments, inlines and body parts that define filename
-  gchar      *disposition;   // for attachments and inlines
+  guint       part_id;        // the depth within the message where this part is located
+  gchar       *content_type;  // content type (text/html, text/plan etc.)
+  GByteArray  *content;       // content data, decoded on demand for inlines and attachments
+  gsize       size;           // size of the decoded content
+  GMimeObject *mime_part;     // the part to decode the content from on demand
+  gchar       *data_uri;      // the content as data URI, encoded once for all cid: references
+  gchar       *content_id;    // for inline content
+  gchar       *filename;      // for attachments, inlines and body parts that define filename
+  gchar       *disposition;   // for attachments and inlines
+  gboolean    undecoded;      // beyond the decoding budget, so neither measured nor ever decoded
 } CollectedPart;
 
 
@@ -410,9 +682,13 @@ static CollectedPart* new_collected_part(guint part_id) {
   part->part_id      = part_id;
   part->content_type = NULL;
   part->content      = NULL;
+  part->size         = 0;
+  part->mime_part    = NULL;
+  part->data_uri     = NULL;
   part->content_id   = NULL;
   part->filename     = NULL;
   part->disposition  = NULL;
+  part->undecoded    = FALSE;
 
   return part;
 }
@@ -429,6 +705,12 @@ static void free_collected_part(gpointer part) {
   if (cpart->content)
      g_byte_array_free(cpart->content, TRUE);
 
+  if (cpart->mime_part)
+    g_object_unref(cpart->mime_part);
+
+  if (cpart->data_uri)
+    g_free(cpart->data_uri);
+
   if (cpart->content_id)
     g_free(cpart->content_id);
 
@@ -453,12 +735,16 @@ static void free_collected_part(gpointer part) {
 typedef struct PartCollectorData {
   guint         recursion_depth;  // We keep track of explicit recursions, and limit them (RECURSION_LIMIT)
   guint         part_id;          // We keep track of the depth within message parts to identify parts later
+  gboolean      measure_parts;    // Whether the decoded size of inlines and attachments is needed
+  ConversionBudget *budget;
   CollectedPart *html_part;
   CollectedPart *text_part;
 
   GPtrArray     *alternative_bodies;  // of CollectedParts
   GPtrArray     *inlines;             // of CollectedParts
   GPtrArray     *attachments;         // of CollectedParts
+
+  GHashTable    *inlines_by_cid;      // lowercase content id => inline CollectedPart replacing cid: URLs
 } PartCollectorData;
 
 
@@ -467,6 +753,8 @@ static PartCollectorData* new_part_collector_data(void) {
 
   pcd->recursion_depth = 0;
   pcd->part_id         = 0;
+  pcd->measure_parts   = TRUE;
+  pcd->budget          = NULL;
 
   pcd->text_part = NULL;
   pcd->html_part = NULL;
@@ -475,10 +763,42 @@ static PartCollectorData* new_part_collector_data(void) {
   pcd->attachments        = g_ptr_array_new_with_free_func((GDestroyNotify) free_collected_part);
   pcd->inlines            = g_ptr_array_new_with_free_func((GDestroyNotify) free_collected_part);
 
+  pcd->inlines_by_cid = NULL;
+
   return pcd;
 }
 
 
+/*
+ * Inlines and attachments are not decoded while collecting, only their size
+ * is measured. Their content is decoded when actually needed.
+ */
+static GByteArray *collected_part_get_content(CollectedPart *part) {
+  if (!part->content && part->mime_part) {
+    GMimeDataWrapper *wrapper = g_mime_part_get_content_object(GMIME_PART(part->mime_part));
+    GMimeStream *mem_stream = g_mime_stream_mem_new();
+    g_mime_stream_mem_set_owner(GMIME_STREAM_MEM(mem_stream), FALSE);
+    g_mime_data_wrapper_write_to_stream(wrapper, mem_stream);
+
+    part->content = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(mem_stream));
+    part->size = part->content->len;
+    g_object_unref(mem_stream);
+  }
+  return part->content;
+}
+
+
+static const gchar *collected_part_get_data_uri(CollectedPart *part) {
+  if (!part->data_uri) {
+    GByteArray *content = collected_part_get_content(part);
+    gchar *base64_data = g_base64_encode((const guchar *) content->data, content->len);
+    part->data_uri = g_strjoin(NULL, "data:", part->content_type, ";base64,", base64_data, NULL);
+    g_free(base64_data);
+  }
+  return part->data_uri;
+}
+
+
 static void free_part_collector_data(PartCollectorData *pcdata) {
   g_return_if_fail(pcdata != NULL);
 
@@ -497,6 +817,9 @@ static void free_part_collector_data(PartCollectorData *pcdata) {
   if (pcdata->attachments)
     g_ptr_array_free(pcdata->attachments, TRUE);
 
+  if (pcdata->inlines_by_cid)
+    g_hash_table_destroy(pcdata->inlines_by_cid);
+
   g_free(pcdata);
 }
 
@@ -505,13 +828,13 @@ static void free_part_collector_data(PartCollectorData *pcdata) {
  * PartExtractorData
  *
  * We use part extractor data when we need to find a specific part within the
- * message. The part_id argument is the part number we want extracted.
+ * message. The part_id argument is the part number we want extracted, and
+ * content keeps the content of that part once found.
  */
 typedef struct PartExtractorData {
-  guint      recursion_depth;
-  guint      part_id;
-  gchar      *content_type;
-  GByteArray *content;
+  guint            recursion_depth;
+  guint            part_id;
+  GMimeDataWrapper *content;
 } PartExtractorData;
 
 
@@ -519,25 +842,58 @@ static PartExtractorData *new_part_extractor_data(guint part_id) {
   PartExtractorData *ped = g_malloc(sizeof(PartExtractorData));
   ped->recursion_depth = 0;
   ped->part_id = part_id;
-  ped->content_type = NULL;
   ped->content = NULL;
   return ped;
 }
 
 
-static void free_part_extractor_data(PartExtractorData *ped, gboolean release_data) {
+static void free_part_extractor_data(PartExtractorData *ped) {
  g_return_if_fail(ped != NULL);
+ g_free(ped);
+}
 
- if (ped->content_type)
-    g_free(ped->content_type);
-
-  if (ped->content)
-    g_byte_array_free(ped->content, release_data);
 
-  g_free(ped);
+/*
+ * PartLocation
+ *
+ * Where the encoded content of a leaf part lies within the message file, as
+ * recorded in the index. Such a part is decoded straight from its byte range,
+ * without parsing the message.
+ */
+typedef struct PartLocation {
+  guint                part_id;
+  gint64               offset;
+  gint64               length;
+  GMimeContentEncoding encoding;
+  gchar                *content_type;
+  gchar                *charset;
+} PartLocation;
+
+
+static void free_part_location(PartLocation *loc) {
+  g_return_if_fail(loc != NULL);
+
+  g_free(loc->content_type);
+  g_free(loc->charset);
+  g_free(loc);
 }
 
 
+/*
+ * StructureBuilderData
+ *
+ * Walks the message like the part extractor does, recording the location of
+ * every leaf part. The structure is only usable when every part is backed by
+ * the mapped message file.
+ */
+typedef struct StructureBuilderData {
+  guint    recursion_depth;
+  guint    part_id;
+  GString  *structure;
+  gboolean complete;
+} StructureBuilderData;
+
+
 /*
  * SANITIZER
  *
@@ -554,77 +910,196 @@ static gchar* special_handling          = "|html|body|";
 static gchar* no_entity_sub             = "|style|";
 
 
+/*
+ * The policy above, compiled once in jmime_init into lookup tables, so
+ * checking a node or an attribute takes a single lookup.
+ */
+#define TAG_PERMITTED        (1 << 0)
+#define TAG_EMPTY            (1 << 1)
+#define TAG_SPECIAL_HANDLING (1 << 2)
+#define TAG_NO_ENTITY_SUB    (1 << 3)
+
+#define ATTRIBUTE_PERMITTED  (1 << 0)
+#define ATTRIBUTE_PROTOCOL   (1 << 1)
+
+#define MAX_PROTOCOL_LENGTH 16
+
+static guint8     tag_policy[GUMBO_TAG_LAST + 1];  // GumboTag => TAG_* flags
+static GHashTable *attribute_policy    = NULL;     // attribute name => ATTRIBUTE_* flags
+static GHashTable *protocol_policy     = NULL;     // permitted protocols (lowercase)
+static GRegex     *protocol_separators = NULL;
+
+
+static void tag_policy_add(const gchar *tags, guint8 flag) {
+  gchar **names = g_strsplit(tags, "|", -1);
+  guint i;
+  for (i = 0; names[i]; i++) {
+    // All tags of the policy are known to gumbo, unknown ones are never permitted
+    GumboTag tag = gumbo_tag_enum(names[i]);
+    if (*names[i] && tag != GUMBO_TAG_UNKNOWN)
+      tag_policy[tag] |= flag;
+  }
+  g_strfreev(names);
+}
+
+
+static void policy_table_add(GHashTable *table, const gchar *names_str, guint flag) {
+  gchar **names = g_strsplit(names_str, "|", -1);
+  guint i;
+  for (i = 0; names[i]; i++) {
+    if (*names[i]) {
+      guint flags = GPOINTER_TO_UINT(g_hash_table_lookup(table, names[i]));
+      g_hash_table_replace(table, g_ascii_strdown(names[i], -1), GUINT_TO_POINTER(flags | flag));
+    }
+  }
+  g_strfreev(names);
+}
+
+
+static void build_sanitizer_policy(void) {
+  memset(tag_policy, 0, sizeof(tag_policy));
+  tag_policy_add(permitted_tags,   TAG_PERMITTED);
+  tag_policy_add(empty_tags,       TAG_EMPTY);
+  tag_policy_add(special_handling, TAG_SPECIAL_HANDLING);
+  tag_policy_add(no_entity_sub,    TAG_NO_ENTITY_SUB);
+
+  attribute_policy = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  policy_table_add(attribute_policy, permitted_attributes, ATTRIBUTE_PERMITTED);
+  policy_table_add(attribute_policy, protocol_attributes,  ATTRIBUTE_PROTOCOL);
+
+  protocol_policy = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  policy_table_add(protocol_policy, permitted_protocols, TRUE);
+
+  protocol_separators = g_regex_new(protocol_separators_regex, G_REGEX_CASELESS | G_REGEX_OPTIMIZE, 0, NULL);
+}
+
+
+static void free_sanitizer_policy(void) {
+  g_hash_table_destroy(attribute_policy);
+  g_hash_table_destroy(protocol_policy);
+  g_regex_unref(protocol_separators);
+  attribute_policy    = NULL;
+  protocol_policy     = NULL;
+  protocol_separators = NULL;
+}
+
+
+static guint8 tag_policy_for(GumboNode *node) {
+  if (node->type != GUMBO_NODE_ELEMENT && node->type != GUMBO_NODE_TEMPLATE)
+    return 0;
+  return tag_policy[node->v.element.tag];
+}
+
+
+static gboolean protocol_permitted(const gchar *protocol) {
+  gchar lowercase[MAX_PROTOCOL_LENGTH];
+  gsize i;
+
+  for (i = 0; protocol[i]; i++) {
+    if (i == MAX_PROTOCOL_LENGTH - 1)
+      return FALSE;
+    lowercase[i] = g_ascii_tolower(protocol[i]);
+  }
+  lowercase[i] = '\0';
+
+  return g_hash_table_contains(protocol_policy, lowercase);
+}
+
+
+/*
+ * SanitizerContext
+ *
+ * What the sanitizer needs to know about the message beyond its HTML: the
+ * inline parts that cid: URLs refer to, and how to reference them, and the
+ * budget of the message it walks the DOM within.
+ */
+typedef struct SanitizerContext {
+  GHashTable       *inlines_by_cid;
+  const gchar      *cid_url_template;  // reference inlines by URL instead of data URI
+  ConversionBudget *budget;
+} SanitizerContext;
+
+
 // Forward declaration
-static GString* sanitize(GumboNode* node, GPtrArray* inlines_ary);
+static void sanitize(GumboNode* node, SanitizerContext *ctx, GString *output);
+
 
+/*
+ * The URL for fetching an inline part, with every {partId} of the template
+ * replaced by its partId.
+ */
+static gchar *cid_url_for(const gchar *cid_url_template, guint part_id) {
+  gchar part_id_str[16];
+  g_snprintf(part_id_str, sizeof(part_id_str), "%u", part_id);
 
-static GString *handle_unknown_tag(GumboStringPiece *text) {
-  if (text->data == NULL)
-    return g_string_new(NULL);
+  gchar **pieces = g_strsplit(cid_url_template, "{partId}", -1);
+  gchar *cid_url = g_strjoinv(part_id_str, pieces);
+  g_strfreev(pieces);
 
-  // work with copy GumboStringPiece to prevent asserts
-  // if try to read same unknown tag name more than once
-  GumboStringPiece gsp = *text;
-  gumbo_tag_from_original_text(&gsp);
-  return g_string_new_len(gsp.data, gsp.length);
+  return cid_url;
 }
 
 
-static GString *get_tag_name(GumboNode *node) {
+static GumboStringPiece get_tag_name(GumboNode *node) {
+  GumboStringPiece tagname = { NULL, 0 };
+
   // work around lack of proper name for document node
-  if (node->type == GUMBO_NODE_DOCUMENT)
-    return g_string_new("document");
+  if (node->type == GUMBO_NODE_DOCUMENT) {
+    tagname.data = "document";
+    tagname.length = strlen(tagname.data);
+    return tagname;
+  }
 
-  const gchar *n_tagname = gumbo_normalized_tagname(node->v.element.tag);
-  GString *tagname = g_string_new(n_tagname);
+  tagname.data = gumbo_normalized_tagname(node->v.element.tag);
+  tagname.length = strlen(tagname.data);
 
-  if (!tagname->len) {
-    g_string_free(tagname, TRUE);
-    return handle_unknown_tag(&node->v.element.original_tag);
+  if (!tagname.length && node->v.element.original_tag.data) {
+    // work with copy GumboStringPiece to prevent asserts
+    // if try to read same unknown tag name more than once
+    tagname = node->v.element.original_tag;
+    gumbo_tag_from_original_text(&tagname);
   }
 
   return tagname;
 }
 
 
-static GString *build_doctype(GumboNode *node) {
-  GString *results = g_string_new(NULL);
+static void build_doctype(GumboNode *node, GString *output) {
   if (node->v.document.has_doctype) {
-    g_string_append(results, "<!DOCTYPE ");
-    g_string_append(results, node->v.document.name);
+    g_string_append(output, "<!DOCTYPE ");
+    g_string_append(output, node->v.document.name);
     const gchar *pi = node->v.document.public_identifier;
     if ((node->v.document.public_identifier != NULL) && strlen(pi) ) {
-        g_string_append(results, " PUBLIC \"");
-        g_string_append(results,node->v.document.public_identifier);
-        g_string_append(results,"\" \"");
-        g_string_append(results,node->v.document.system_identifier);
-        g_string_append(results,"\"");
+        g_string_append(output, " PUBLIC \"");
+        g_string_append(output,node->v.document.public_identifier);
+        g_string_append(output,"\" \"");
+        g_string_append(output,node->v.document.system_identifier);
+        g_string_append(output,"\"");
     }
-    g_string_append(results,">\n");
+    g_string_append(output,">\n");
   }
-  return results;
 }
 
 
-static GString *build_attributes(GumboAttribute *at, gboolean no_entities, GPtrArray *inlines_ary) {
-  gchar *key = g_strjoin(NULL, "|", at->name, "|", NULL);
-  gchar *key_pattern = g_regex_escape_string(key, -1);
-  g_free(key);
+/*
+ * Appends the attribute if permitted, given its (lowercase) name, its value
+ * with entities resolved, and the quote it was written with.
+ */
+static void build_attribute(const gchar *name, const gchar *value, gchar quote, gboolean no_entities, SanitizerContext *ctx, GString *output) {
+  guint policy = GPOINTER_TO_UINT(g_hash_table_lookup(attribute_policy, name));
 
-  gboolean is_permitted_attribute = g_regex_match_simple(key_pattern, permitted_attributes, G_REGEX_CASELESS, 0);
-  gboolean is_protocol_attribute  = g_regex_match_simple(key_pattern, protocol_attributes, G_REGEX_CASELESS, 0);
+  gboolean is_permitted_attribute = policy & ATTRIBUTE_PERMITTED;
+  gboolean is_protocol_attribute  = policy & ATTRIBUTE_PROTOCOL;
   gchar *cid_content_id = NULL;
 
-  g_free(key_pattern);
-
   if (!is_permitted_attribute)
-    return g_string_new(NULL);
+    return;
 
-  GString *attr_value = g_string_new(at->value);
+  GString *attr_value = g_string_new(value);
   gstr_strip(attr_value);
 
   if (is_protocol_attribute) {
-    gchar **protocol_parts = g_regex_split_simple(protocol_separators_regex, attr_value->str, G_REGEX_CASELESS, 0);
+    gchar **protocol_parts = g_regex_split(protocol_separators, attr_value->str, 0);
     guint pparts_length = 0;
 
     while (protocol_parts[pparts_length])
@@ -633,11 +1108,7 @@ static GString *build_attributes(GumboAttribute *at, gboolean no_entities, GPtrA
     gboolean is_permitted_protocol = FALSE;
 
     if (pparts_length) {
-      gchar *attr_protocol = g_strjoin(NULL, "|", protocol_parts[0], "|", NULL);
-      gchar *attr_prot_pattern = g_regex_escape_string(attr_protocol, -1);
-      g_free(attr_protocol);
-      is_permitted_protocol = g_regex_match_simple(attr_prot_pattern, permitted_protocols, G_REGEX_CASELESS, 0);
-      g_free(attr_prot_pattern);
+      is_permitted_protocol = protocol_permitted(protocol_parts[0]);
 
       if (is_permitted_protocol && !g_ascii_strcasecmp(protocol_parts[0], "cid"))
         cid_content_id = g_strdup(protocol_parts[1]);
@@ -646,26 +1117,26 @@ static GString *build_attributes(GumboAttribute *at, gboolean no_entities, GPtrA
 
     if (!is_permitted_protocol) {
       g_string_free(attr_value, TRUE);
-      return g_string_new(NULL);
+      return;
     }
   }
 
   if (cid_content_id) {
     gboolean cid_replaced = FALSE;
-    if (inlines_ary && inlines_ary->len) {
-      guint i;
-      for (i = 0; i < inlines_ary->len; i++) {
-        CollectedPart *inline_body = g_ptr_array_index(inlines_ary, i);
-        if (inline_body->content_id && !g_ascii_strcasecmp(inline_body->content_id, cid_content_id)) {
-          if (inline_body->content->len < MAX_CID_SIZE) {
-            gchar *base64_data = g_base64_encode((const guchar *) inline_body->content->data, inline_body->content->len);
-            gchar *new_attr_value = g_strjoin(NULL, "data:", inline_body->content_type, ";base64,", base64_data, NULL);
-            g_string_assign(attr_value, new_attr_value);
-            g_free(base64_data);
-            g_free(new_attr_value);
-            cid_replaced = TRUE;
-          }
-        }
+    if (ctx->inlines_by_cid) {
+      gchar *cid_key = g_ascii_strdown(cid_content_id, -1);
+      CollectedPart *inline_body = g_hash_table_lookup(ctx->inlines_by_cid, cid_key);
+      g_free(cid_key);
+
+      if (inline_body && ctx->cid_url_template) {
+        gchar *cid_url = cid_url_for(ctx->cid_url_template, inline_body->part_id);
+        g_string_assign(attr_value, cid_url);
+        g_free(cid_url);
+        cid_replaced = TRUE;
+
+      } else if (inline_body) {
+        g_string_assign(attr_value, collected_part_get_data_uri(inline_body));
+        cid_replaced = TRUE;
       }
     }
 
@@ -678,14 +1149,12 @@ static GString *build_attributes(GumboAttribute *at, gboolean no_entities, GPtrA
     g_free(cid_content_id);
   }
 
-  GString *atts = g_string_new(" ");
-  g_string_append(atts, at->name);
+  g_string_append_c(output, ' ');
+  g_string_append(output, name);
 
   // how do we want to handle attributes with empty values
   // <input type="checkbox" checked />  or <input type="checkbox" checked="" />
 
-  gchar quote = at->original_value.data[0];
-
   if (attr_value->len || (quote == '"') || (quote == '\'')) {
 
     gchar *qs = "";
@@ -695,38 +1164,23 @@ static GString *build_attributes(GumboAttribute *at, gboolean no_entities, GPtrA
     if (quote == '"')
       qs = "\"";
 
-    g_string_append(atts, "=");
-    g_string_append(atts, qs);
+    g_string_append(output, "=");
+    g_string_append(output, qs);
 
-    if (no_entities) {
-      g_string_append(atts, attr_value->str);
-    } else {
-      GString *subd = gstr_substitute_xml_entities_into_attributes(quote, attr_value->str);
-      g_string_append(atts, subd->str);
-      g_string_free(subd, TRUE);
-    }
-    g_string_append(atts, qs);
+    if (no_entities)
+      g_string_append(output, attr_value->str);
+    else
+      gstr_append_xml_escaped(output, attr_value->str, attr_value->len, quote);
+    g_string_append(output, qs);
   }
 
   g_string_free(attr_value, TRUE);
-  return atts;
 }
 
 
 
-static GString *sanitize_contents(GumboNode* node, GPtrArray *inlines_ary) {
-  GString *contents = g_string_new(NULL);
-  GString *tagname  = get_tag_name(node);
-
-  gchar *key = g_strjoin(NULL, "|", tagname->str, "|", NULL);
-  g_string_free(tagname, TRUE);
-
-  // Since we include pipes (|) we have to escape the regex string
-  gchar *key_pattern = g_regex_escape_string(key, -1);
-  g_free(key);
-
-  gboolean no_entity_substitution = g_regex_match_simple(key_pattern, no_entity_sub, G_REGEX_CASELESS, 0);
-  g_free(key_pattern);
+static void sanitize_contents(GumboNode* node, SanitizerContext *ctx, GString *output) {
+  gboolean no_entity_substitution = tag_policy_for(node) & TAG_NO_ENTITY_SUB;
 
   // build up result for each child, recursively if need be
   GumboVector* children = &node->v.element.children;
@@ -734,119 +1188,100 @@ static GString *sanitize_contents(GumboNode* node, GPtrArray *inlines_ary) {
   for (i = 0; i < children->length; ++i) {
     GumboNode* child = (GumboNode*) (children->data[i]);
 
+    // Open elements still get closed by the callers
+    if (!budget_take_node(ctx->budget))
+      break;
+
     if (child->type == GUMBO_NODE_TEXT) {
-      if (no_entity_substitution) {
-        g_string_append(contents, child->v.text.text);
-      } else {
-        GString *subd = gstr_substitute_xml_entities_into_text(child->v.text.text);
-        g_string_append(contents, subd->str);
-        g_string_free(subd, TRUE);
-      }
+      if (no_entity_substitution)
+        g_string_append(output, child->v.text.text);
+      else
+        gstr_append_xml_escaped(output, child->v.text.text, strlen(child->v.text.text), '\0');
 
     } else if (child->type == GUMBO_NODE_ELEMENT ||
                child->type == GUMBO_NODE_TEMPLATE) {
 
-      GString *child_ser = sanitize(child, inlines_ary);
-      g_string_append(contents, child_ser->str);
-      g_string_free(child_ser, TRUE);
+      sanitize(child, ctx, output);
 
     } else if (child->type == GUMBO_NODE_WHITESPACE) {
       // keep all whitespace to keep as close to original as possible
-      g_string_append(contents, child->v.text.text);
+      g_string_append(output, child->v.text.text);
     } else if (child->type != GUMBO_NODE_COMMENT) {
       // Does this actually exist: (child->type == GUMBO_NODE_CDATA)
       fprintf(stderr, "unknown element of type: %d\n", child->type);
     }
   }
-  return contents;
 }
 
 
-static GString *sanitize(GumboNode* node, GPtrArray* inlines_ary) {
+/*
+ * Serializes the sanitized node into the output, which is shared by the
+ * whole recursion so that nothing gets copied from child to parent.
+ */
+static void sanitize(GumboNode* node, SanitizerContext *ctx, GString *output) {
   // special case the document node
   if (node->type == GUMBO_NODE_DOCUMENT) {
-    GString *results = build_doctype(node);
-    GString *node_ser = sanitize_contents(node, inlines_ary);
-    g_string_append(results, node_ser->str);
-    g_string_free(node_ser, TRUE);
-    return results;
+    build_doctype(node, output);
+    sanitize_contents(node, ctx, output);
+    return;
   }
 
-  GString *tagname = get_tag_name(node);
-  gchar *key = g_strjoin(NULL, "|", tagname->str, "|", NULL);
+  guint8 policy = tag_policy_for(node);
 
-  gchar *key_pattern = g_regex_escape_string(key, -1);
-  g_free(key);
+  gboolean need_special_handling     = policy & TAG_SPECIAL_HANDLING;
+  gboolean is_empty_tag              = policy & TAG_EMPTY;
+  gboolean no_entity_substitution    = policy & TAG_NO_ENTITY_SUB;
+  gboolean tag_permitted             = policy & TAG_PERMITTED;
 
+  if (!need_special_handling && !tag_permitted)
+    return;
 
-  gboolean need_special_handling     = g_regex_match_simple(key_pattern, special_handling,   G_REGEX_CASELESS, 0);
-  gboolean is_empty_tag              = g_regex_match_simple(key_pattern, empty_tags,         G_REGEX_CASELESS, 0);
-  gboolean no_entity_substitution    = g_regex_match_simple(key_pattern, no_entity_sub,      G_REGEX_CASELESS, 0);
-  gboolean tag_permitted             = g_regex_match_simple(key_pattern, permitted_tags,     G_REGEX_CASELESS, 0);
-
-  g_free(key_pattern);
-
-  if (!need_special_handling && !tag_permitted) {
-    g_string_free(tagname, TRUE);
-    return g_string_new(NULL);
-  }
+  GumboStringPiece tagname = get_tag_name(node);
 
-  GString *close = g_string_new(NULL);
-  GString *closeTag = g_string_new(NULL);
-  GString *atts = g_string_new(NULL);
+  g_string_append_c(output, '<');
+  g_string_append_len(output, tagname.data, tagname.length);
 
   const GumboVector *attribs = &node->v.element.attributes;
   guint i;
   for (i = 0; i < attribs->length; ++i) {
     GumboAttribute* at = (GumboAttribute*)(attribs->data[i]);
-    GString *attsstr = build_attributes(at, no_entity_substitution, inlines_ary);
-    g_string_append(atts, attsstr->str);
-    g_string_free(attsstr, TRUE);
+    // Gumbo normalizes attribute names to lowercase
+    build_attribute(at->name, at->value, at->original_value.data[0], no_entity_substitution, ctx, output);
   }
 
   if (node->type == GUMBO_NODE_ELEMENT) {
     if ((node->v.element.tag == GUMBO_TAG_A) ||
         (node->v.element.tag == GUMBO_TAG_FORM))
-      g_string_append(atts, " target=\"_blank\"");
+      g_string_append(output, " target=\"_blank\"");
 
     if (node->v.element.tag == GUMBO_TAG_FORM)
-      g_string_append(atts, " onSubmit=\"return confirm('This form will submit to an external URL. Are you sure you want to continue?');\"");
-  }
-
-  if (is_empty_tag) {
-    g_string_append_c(close, '/');
-  } else {
-    g_string_append_printf(closeTag, "</%s>", tagname->str);
-  }
-
-  GString *contents = sanitize_contents(node, inlines_ary);
-
-  if (need_special_handling) {
-    gstr_strip(contents);
-    g_string_append_c(contents, '\n');
+      g_string_append(output, " onSubmit=\"return confirm('This form will submit to an external URL. Are you sure you want to continue?');\"");
   }
 
-  GString *results = g_string_new(NULL);
-  g_string_append_printf(results, "<%s%s%s>", tagname->str, atts->str, close->str);
-  g_string_free(atts, TRUE);
+  if (is_empty_tag)
+    g_string_append_c(output, '/');
 
-  g_string_free(tagname, TRUE);
+  g_string_append_c(output, '>');
 
   if (need_special_handling)
-    g_string_append_c(results, '\n');
-
-  g_string_append(results, contents->str);
-  g_string_free(contents, TRUE);
+    g_string_append_c(output, '\n');
 
-  g_string_append(results, closeTag->str);
+  gsize contents_start = output->len;
+  sanitize_contents(node, ctx, output);
 
-  if (need_special_handling)
-    g_string_append_c(results, '\n');
+  if (need_special_handling) {
+    gstr_strip_from(output, contents_start);
+    g_string_append_c(output, '\n');
+  }
 
-  g_string_free(close, TRUE);
-  g_string_free(closeTag, TRUE);
+  if (!is_empty_tag) {
+    g_string_append(output, "</");
+    g_string_append_len(output, tagname.data, tagname.length);
+    g_string_append_c(output, '>');
+  }
 
-  return results;
+  if (need_special_handling)
+    g_string_append_c(output, '\n');
 }
 
 
@@ -855,74 +1290,351 @@ static GString *sanitize(GumboNode* node, GPtrArray* inlines_ary) {
 /*
  * TEXTIZER
  *
+ * Appends the visible text of the node to the output, stripping every text
+ * node and separating non-empty ones by a single space.
+ *
+ * With a limit, the walk stops once the output holds more than limit bytes,
+ * which is always a prefix of the complete text; text nodes are copied only
+ * as far as needed for that. It also stops once the budget runs out of DOM
+ * nodes.
  */
-static GString *textize(const GumboNode* node) {
+static void textize_into(const GumboNode* node, GString *output, gsize limit, ConversionBudget *budget) {
   if (node->type == GUMBO_NODE_TEXT) {
-    return g_string_new(node->v.text.text);
+    const gchar *start = node->v.text.text;
+    const gchar *end   = start + strlen(start);
+
+    gc_strip_bounds(&start, &end);
+
+    // One byte beyond the limit tells whether the cut splits a character
+    if (limit) {
+      gsize room = (output->len <= limit) ? limit + 1 - output->len : 1;
+      if ((gsize) (end - start) > room)
+        end = start + room;
+    }
+
+    g_string_append_len(output, start, end - start);
 
   } else if (node->type == GUMBO_NODE_ELEMENT &&
              node->v.element.tag != GUMBO_TAG_SCRIPT &&
              node->v.element.tag != GUMBO_TAG_STYLE) {
 
     const GumboVector* children = &node->v.element.children;
-    GString *contents = g_string_new(NULL);
+    gsize contents_start = output->len;
 
     guint i;
     for (i = 0; i < children->length; ++i) {
-      GString *text = textize((GumboNode*) children->data[i]);
-      gstr_strip(text);
+      if (limit && output->len > limit)
+        break;
+
+      if (!budget_take_node(budget))
+        break;
 
-      if (i && text->len && contents->len)
-        g_string_append_c(contents, ' ');
+      gsize separator_start = output->len;
 
-      g_string_append(contents, text->str);
-      g_string_free(text, TRUE);
+      if (output->len > contents_start)
+        g_string_append_c(output, ' ');
+
+      gsize text_start = output->len;
+      textize_into((GumboNode*) children->data[i], output, limit, budget);
+
+      // Children without text do not get separated
+      if (output->len == text_start)
+        g_string_truncate(output, separator_start);
     }
-    return contents;
-  } else {
-    return g_string_new(NULL);
   }
 }
 
 
-
 /*
- *
- *
+ * The visible text of the node, cut at a character boundary within limit
+ * bytes unless the limit is 0.
  */
-static GMimeMessage* gmime_message_from_stream(GMimeStream *stream) {
-  g_return_val_if_fail(stream != NULL, NULL);
-
-  GMimeParser *parser = g_mime_parser_new_with_stream(stream);
-  if (!parser) {
-    g_printerr("failed to create parser\r\n");
-    return NULL;
-  }
+static GString *textize(const GumboNode* node, gsize limit, ConversionBudget *budget) {
+  GString *contents = g_string_new(NULL);
+  textize_into(node, contents, limit, budget);
 
-  GMimeMessage *message = g_mime_parser_construct_message(parser);
-  g_object_unref (parser);
-  if (!message) {
-    g_printerr("failed to construct message\r\n");
-    return NULL;
-  }
+  if (limit)
+    gstr_truncate_utf8(contents, limit);
 
-  return message;
+  return contents;
 }
 
 
+
 /*
+ * PLAIN TEXT
  *
- *
+ * Plain text bodies come out of the GMime HTML filter as a small set of
+ * tokens: escaped text, <br>, links and coloured citations. These are
+ * serialized here exactly as Gumbo and the sanitizer would serialize them,
+ * and the text is collected as the textizer would, without building a
+ * document. Anything outside of that set is left to Gumbo.
  */
-static GMimeMessage *gmime_message_from_file(FILE *file) {
-  g_return_val_if_fail(file != NULL, NULL);
+#define PLAIN_TAG_A    'a'
+#define PLAIN_TAG_FONT 'f'
 
-  GMimeStream *stream = g_mime_stream_file_new(file);
 
-  if (!stream) {
-    g_printerr("file stream could not be opened\r\n");
-    fclose(file);
-    return NULL;
+/*
+ * Resolves the entity at *p as Gumbo does within text, appending the
+ * character to the text. Only entities the HTML filter writes are resolved.
+ */
+static gboolean plain_text_entity(const gchar **p, const gchar *end, GString *text) {
+  const gchar *entity = *p + 1;
+
+  // An ampersand not starting a reference stays as it is
+  if (entity == end || (!g_ascii_isalnum(*entity) && *entity != '#')) {
+    g_string_append_c(text, '&');
+    *p = entity;
+    return TRUE;
+  }
+
+  static const struct { const gchar *name; const gchar *value; } entities[] = {
+    { "lt;", "<" }, { "gt;", ">" }, { "amp;", "&" }, { "quot;", "\"" }, { "nbsp;", "\xc2\xa0" }
+  };
+
+  guint i;
+  for (i = 0; i < G_N_ELEMENTS(entities); i++) {
+    gsize name_len = strlen(entities[i].name);
+    if ((gsize) (end - entity) >= name_len && !strncmp(entity, entities[i].name, name_len)) {
+      g_string_append(text, entities[i].value);
+      *p = entity + name_len;
+      return TRUE;
+    }
+  }
+
+  if (*entity != '#')
+    return FALSE;
+
+  // Decimal references to characters Gumbo takes over unchanged
+  gunichar c = 0;
+  const gchar *digit = entity + 1;
+  while (digit < end && g_ascii_isdigit(*digit) && c <= 0x10FFFF)
+    c = c * 10 + (*digit++ - '0');
+
+  if (digit == entity + 1 || digit == end || *digit != ';')
+    return FALSE;
+
+  if (c < 0x20 || (c >= 0x7F && c < 0xA0) || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF ||
+      (c >= 0xFDD0 && c <= 0xFDEF) || (c & 0xFFFE) == 0xFFFE)
+    return FALSE;
+
+  g_string_append_unichar(text, c);
+  *p = digit + 1;
+  return TRUE;
+}
+
+
+/*
+ * Reads the quoted value of the one attribute the HTML filter writes, up to
+ * the end of the tag. An ampersand in there must not start a reference.
+ */
+static gboolean plain_attribute_value(const gchar **p, const gchar *end, GString *value) {
+  const gchar *v = *p;
+
+  for (; v < end && *v != '"'; v++) {
+    if (*v == '&') {
+      const gchar *name_end = v + 1;
+      while (name_end < end && g_ascii_isalnum(*name_end))
+        name_end++;
+
+      // Like "?a=1&b=2": no reference within attribute values
+      if (name_end < end && (name_end == v + 1 ? *name_end == '#' : *name_end != '='))
+        return FALSE;
+    }
+    g_string_append_c(value, *v);
+  }
+
+  if (v + 1 >= end || v[1] != '>')
+    return FALSE;
+
+  *p = v + 2;
+  return TRUE;
+}
+
+
+static gboolean plain_has_prefix(const gchar *p, const gchar *end, const gchar *prefix) {
+  gsize prefix_len = strlen(prefix);
+  return (gsize) (end - p) >= prefix_len && !memcmp(p, prefix, prefix_len);
+}
+
+
+static void plain_flush_text(GString *segment, GString *text, gsize text_limit) {
+  const gchar *start = segment->str;
+  const gchar *end   = segment->str + segment->len;
+  gc_strip_bounds(&start, &end);
+
+  if (text && start < end && (!text_limit || text->len <= text_limit)) {
+    if (text->len)
+      g_string_append_c(text, ' ');
+    g_string_append_len(text, start, end - start);
+  }
+
+  g_string_truncate(segment, 0);
+}
+
+
+/*
+ * Converts the output of the HTML filter into the sanitized document (unless
+ * html is NULL) and its visible text (unless text is NULL), stopping to
+ * collect the text beyond text_limit bytes (unless 0). Returns FALSE when
+ * Gumbo has to do it.
+ */
+static gboolean plain_html_convert(const gchar *filtered, gsize len, SanitizerContext *ctx,
+                                   GString *html, GString *text, gsize text_limit) {
+  // Gumbo would replace or drop these
+  if (memchr(filtered, '\r', len) || memchr(filtered, '\0', len) || !g_utf8_validate(filtered, len, NULL))
+    return FALSE;
+
+  const gchar *p   = filtered;
+  const gchar *end = filtered + len;
+
+  GString *segment = g_string_new(NULL);
+  GString *value   = g_string_new(NULL);
+  gchar open_tags[2];
+  guint depth = 0;
+  gboolean converted = TRUE;
+
+  gsize body_start = 0;
+  if (html) {
+    g_string_append(html, "<html>\n<body>\n");
+    body_start = html->len;
+  }
+
+  while (p < end && converted) {
+    if (*p == '<') {
+      plain_flush_text(segment, text, text_limit);
+
+      if (plain_has_prefix(p, end, "<br>")) {
+        if (html)
+          g_string_append(html, "<br/>");
+        p += strlen("<br>");
+
+      } else if (plain_has_prefix(p, end, "</a>") && depth && open_tags[depth - 1] == PLAIN_TAG_A) {
+        if (html)
+          g_string_append(html, "</a>");
+        depth--;
+        p += strlen("</a>");
+
+      } else if (plain_has_prefix(p, end, "</font>") && depth && open_tags[depth - 1] == PLAIN_TAG_FONT) {
+        if (html)
+          g_string_append(html, "</font>");
+        depth--;
+        p += strlen("</font>");
+
+      } else if (plain_has_prefix(p, end, "<a href=\"") && (!depth || (depth == 1 && open_tags[0] == PLAIN_TAG_FONT))) {
+        p += strlen("<a href=\"");
+        g_string_truncate(value, 0);
+        converted = plain_attribute_value(&p, end, value);
+
+        if (converted && html) {
+          g_string_append(html, "<a");
+          build_attribute("href", value->str, '"', FALSE, ctx, html);
+          g_string_append(html, " target=\"_blank\">");
+        }
+        open_tags[depth++] = PLAIN_TAG_A;
+
+      } else if (plain_has_prefix(p, end, "<font color=\"") && !depth) {
+        p += strlen("<font color=\"");
+        g_string_truncate(value, 0);
+        converted = plain_attribute_value(&p, end, value);
+
+        if (converted && html) {
+          g_string_append(html, "<font");
+          build_attribute("color", value->str, '"', FALSE, ctx, html);
+          g_string_append_c(html, '>');
+        }
+        open_tags[depth++] = PLAIN_TAG_FONT;
+
+      } else {
+        converted = FALSE;
+      }
+
+    } else if (*p == '&') {
+      gsize segment_start = segment->len;
+      converted = plain_text_entity(&p, end, segment);
+
+      if (converted && html)
+        gstr_append_xml_escaped(html, segment->str + segment_start, segment->len - segment_start, '\0');
+
+    } else {
+      const gchar *run = p;
+      while (p < end && *p != '<' && *p != '&') {
+        // Control characters other than tab and newline are not expected
+        if ((guchar) *p < 0x20 && *p != '\t' && *p != '\n')
+          break;
+        if (*p == 0x7F)
+          break;
+        p++;
+      }
+
+      if (p == run) {
+        converted = FALSE;
+      } else {
+        g_string_append_len(segment, run, p - run);
+        if (html)
+          gstr_append_xml_escaped(html, run, p - run, '\0');
+      }
+    }
+  }
+
+  // Gumbo closes open elements on its own terms
+  if (depth)
+    converted = FALSE;
+
+  if (converted) {
+    plain_flush_text(segment, text, text_limit);
+
+    if (html) {
+      gstr_strip_from(html, body_start);
+      g_string_append(html, "\n</body>\n</html>\n");
+    }
+  }
+
+  g_string_free(segment, TRUE);
+  g_string_free(value, TRUE);
+  return converted;
+}
+
+
+
+
+/*
+ *
+ *
+ */
+static GMimeMessage* gmime_message_from_stream(GMimeStream *stream) {
+  g_return_val_if_fail(stream != NULL, NULL);
+
+  GMimeParser *parser = g_mime_parser_new_with_stream(stream);
+  if (!parser) {
+    g_printerr("failed to create parser\r\n");
+    return NULL;
+  }
+
+  GMimeMessage *message = g_mime_parser_construct_message(parser);
+  g_object_unref (parser);
+  if (!message) {
+    g_printerr("failed to construct message\r\n");
+    return NULL;
+  }
+
+  return message;
+}
+
+
+/*
+ *
+ *
+ */
+static GMimeMessage *gmime_message_from_file(FILE *file) {
+  g_return_val_if_fail(file != NULL, NULL);
+
+  GMimeStream *stream = g_mime_stream_file_new(file);
+
+  if (!stream) {
+    g_printerr("file stream could not be opened\r\n");
+    fclose(file);
+    return NULL;
   }
 
   // Being owner of the stream will automatically close the file when released
@@ -946,25 +1658,147 @@ static GMimeMessage *gmime_message_from_file(FILE *file) {
 static GMimeMessage *gmime_message_from_path(const gchar *path) {
   g_return_val_if_fail(path != NULL, NULL);
 
-  // Note: we don't need to worry about closing the file, as it will be closed by the
-  // stream within message_from_file.
-  FILE *file = fopen (path, "r");
+  int fd = open(path, O_RDONLY);
 
-  if (!file) {
+  if (fd < 0) {
     g_printerr("cannot open file '%s': %s\r\n", path, g_strerror(errno));
     return NULL;
   }
 
-  GMimeMessage *message = gmime_message_from_file(file);
-  if (!message) {
-    g_printerr("message could not be constructed from file '%s': %s\r\n", path, g_strerror(errno));
+  // Regular files are mapped into memory, so the parser reads them without
+  // copying through stdio buffers; pipes and alike are read as a file stream.
+  struct stat st;
+  GMimeStream *stream = NULL;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+    stream = g_mime_stream_mmap_new(fd, PROT_READ, MAP_PRIVATE);
+
+  if (!stream) {
+    // Note: we don't need to worry about closing the file, as it will be closed by the
+    // stream within message_from_file.
+    FILE *file = fdopen(fd, "r");
+    if (!file) {
+      g_printerr("cannot open file '%s': %s\r\n", path, g_strerror(errno));
+      close(fd);
+      return NULL;
+    }
+
+    GMimeMessage *message = gmime_message_from_file(file);
+    if (!message)
+      g_printerr("message could not be constructed from file '%s': %s\r\n", path, g_strerror(errno));
+
+    return message;
+  }
+
+  // The mmap stream owns the descriptor, and unmaps and closes it when released
+  GMimeMessage *message = gmime_message_from_stream(stream);
+  g_object_unref(stream);
+
+  if (!message)
+    g_printerr("message could not be constructed from file '%s'\r\n", path);
+
+  return message;
+}
+
+
+/*
+ * Length of the header block, including the empty line that ends it, or -1
+ * if the data read so far does not contain the end of the headers yet.
+ */
+static gssize header_block_length(const guint8 *data, gsize len, gsize from) {
+  const guint8 *end = data + len;
+  const guint8 *nl  = data + from;
+
+  while ((nl = memchr(nl, '\n', end - nl)) != NULL) {
+    if (nl + 1 < end && nl[1] == '\n')
+      return nl + 2 - data;
+
+    if (nl + 2 < end && nl[1] == '\r' && nl[2] == '\n')
+      return nl + 3 - data;
+
+    nl++;
+  }
+  return -1;
+}
+
+
+/*
+ * Parses only the header block of the message file, which is read up to the
+ * first empty line (or MAX_HEADER_SIZE) and never beyond.
+ */
+static GMimeMessage *gmime_message_headers_from_path(const gchar *path) {
+  g_return_val_if_fail(path != NULL, NULL);
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    g_printerr("cannot open file '%s': %s\r\n", path, g_strerror(errno));
     return NULL;
   }
 
+  GByteArray *headers = g_byte_array_sized_new(HEADER_READ_SIZE);
+  guint8 buffer[HEADER_READ_SIZE];
+  gsize read_size;
+
+  while (headers->len < MAX_HEADER_SIZE && (read_size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    // The empty line may begin within the previously read chunk
+    gsize scan_from = headers->len > 2 ? headers->len - 2 : 0;
+    g_byte_array_append(headers, buffer, read_size);
+
+    gssize length = header_block_length(headers->data, headers->len, scan_from);
+    if (length >= 0) {
+      g_byte_array_set_size(headers, length);
+      break;
+    }
+  }
+  fclose(file);
+
+  // The stream owns the byte array
+  GMimeStream *stream = g_mime_stream_mem_new_with_byte_array(headers);
+  GMimeMessage *message = gmime_message_from_stream(stream);
+  g_object_unref(stream);
+
+  if (!message)
+    g_printerr("message headers could not be constructed from file '%s'\r\n", path);
+
   return message;
 }
 
 
+/*
+ * The encoded content, as far as the budget may decode it; it never decodes
+ * to more bytes than it has. Returns a new reference.
+ */
+static GMimeDataWrapper *budget_data_wrapper(ConversionBudget *budget, GMimeDataWrapper *wrapper) {
+  if (!budget)
+    return g_object_ref(wrapper);
+
+  GMimeStream *stream = g_mime_data_wrapper_get_stream(wrapper);
+  gsize decodable = budget_decodable_bytes(budget);
+  gint64 length = g_mime_stream_length(stream);
+
+  if (length < 0 || (guint64) length <= decodable)
+    return g_object_ref(wrapper);
+
+  budget->truncated = TRUE;
+
+  GMimeStream *substream = g_mime_stream_substream(stream, stream->bound_start, stream->bound_start + decodable);
+  GMimeDataWrapper *cut = g_mime_data_wrapper_new_with_stream(substream, g_mime_data_wrapper_get_encoding(wrapper));
+  g_object_unref(substream);
+  return cut;
+}
+
+
+static gboolean budget_can_decode(ConversionBudget *budget, GMimeDataWrapper *wrapper) {
+  if (!budget)
+    return TRUE;
+
+  gint64 length = g_mime_stream_length(g_mime_data_wrapper_get_stream(wrapper));
+  if (length < 0 || (guint64) length <= budget_decodable_bytes(budget))
+    return TRUE;
+
+  budget->truncated = TRUE;
+  return FALSE;
+}
+
 
 /*
  *
@@ -1062,7 +1896,10 @@ static void collect_part(GMimeObject *part, PartCollectorData *fdata, gboolean m
       g_mime_stream_filter_add(GMIME_STREAM_FILTER(filtered_mem_stream), enriched_filter);
       g_object_unref(enriched_filter);
     }
-    g_mime_data_wrapper_write_to_stream(wrapper, filtered_mem_stream);
+    // Bodies beyond the decoding budget are cut short
+    GMimeDataWrapper *budget_wrapper = budget_data_wrapper(fdata->budget, wrapper);
+    g_mime_data_wrapper_write_to_stream(budget_wrapper, filtered_mem_stream);
+    g_object_unref(budget_wrapper);
 
     // Very important! Flush the the stream and get all content through.
     g_mime_stream_flush(filtered_mem_stream);
@@ -1074,6 +1911,9 @@ static void collect_part(GMimeObject *part, PartCollectorData *fdata, gboolean m
     g_object_unref(filtered_mem_stream);
     g_object_unref(mem_stream);
 
+    c_part->size = c_part->content->len;
+    budget_count_decoded(fdata->budget, c_part->size);
+
     // Without content, the collected body part is of no use, so we ignore it.
     if (c_part->content->len == 0) {
       free_collected_part(c_part);
@@ -1091,12 +1931,20 @@ static void collect_part(GMimeObject *part, PartCollectorData *fdata, gboolean m
     }
 
   } else {
-    GMimeStream *attachment_mem_stream = g_mime_stream_mem_new();
-    g_mime_stream_mem_set_owner (GMIME_STREAM_MEM(attachment_mem_stream), FALSE);
-    g_mime_data_wrapper_write_to_stream(wrapper, attachment_mem_stream);
-
-    c_part->content = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(attachment_mem_stream));
-    g_object_unref(attachment_mem_stream);
+    c_part->mime_part = g_object_ref(part);
+
+    // Decode into a counting sink, keeping nothing but the size. Parts
+    // beyond the decoding budget are listed as they are.
+    if (fdata->measure_parts && !budget_can_decode(fdata->budget, wrapper)) {
+      c_part->undecoded = TRUE;
+
+    } else if (fdata->measure_parts) {
+      GMimeStream *null_stream = g_mime_stream_null_new();
+      g_mime_data_wrapper_write_to_stream(wrapper, null_stream);
+      c_part->size = GMIME_STREAM_NULL(null_stream)->written;
+      budget_count_decoded(fdata->budget, c_part->size);
+      g_object_unref(null_stream);
+    }
 
     // Some content may not have disposition defined so we need to determine better what it is
     if ((disposition && !g_ascii_strcasecmp(disposition->disposition, GMIME_DISPOSITION_INLINE)) ||
@@ -1137,7 +1985,9 @@ static void collector_foreach_callback(GMimeObject *parent, GMimeObject *part, g
   } else if (GMIME_IS_MULTIPART(part)) {
     // Nothing special needed on multipart, let descend further
   } else if (GMIME_IS_PART(part)) {
-    collect_part(part, fdata, GMIME_IS_MULTIPART(parent));
+    // Parts beyond the budget are left out, but keep the partIds in place
+    if (budget_take_part(fdata->budget))
+      collect_part(part, fdata, GMIME_IS_MULTIPART(parent));
     fdata->part_id++;
   } else {
     g_assert_not_reached();
@@ -1145,9 +1995,37 @@ static void collector_foreach_callback(GMimeObject *parent, GMimeObject *part, g
 }
 
 
-static PartCollectorData *collect_parts(GMimeMessage *message) {
+/*
+ * Content ids compare case insensitively. When several inlines share one,
+ * the last one smaller than max_cid_size replaces the cid: URLs.
+ */
+static GHashTable *index_inlines_by_cid(GPtrArray *inlines, gsize max_cid_size) {
+  GHashTable *inlines_by_cid = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  guint i;
+  for (i = 0; i < inlines->len; i++) {
+    CollectedPart *inline_part = g_ptr_array_index(inlines, i);
+    if (inline_part->content_id && !inline_part->undecoded && inline_part->size < max_cid_size)
+      g_hash_table_replace(inlines_by_cid, g_ascii_strdown(inline_part->content_id, -1), inline_part);
+  }
+
+  return inlines_by_cid;
+}
+
+
+/*
+ * Inlines are indexed by content id when max_cid_size is given, which takes
+ * measured parts to tell their size.
+ */
+static PartCollectorData *collect_parts(GMimeMessage *message, gboolean measure_parts, gsize max_cid_size, ConversionBudget *budget) {
   PartCollectorData *pc = new_part_collector_data();
+  pc->measure_parts = measure_parts;
+  pc->budget        = budget;
   g_mime_message_foreach(message, collector_foreach_callback, pc);
+
+  if (max_cid_size && measure_parts && pc->inlines->len)
+    pc->inlines_by_cid = index_inlines_by_cid(pc->inlines, max_cid_size);
+
   return pc;
 }
 
@@ -1159,12 +2037,9 @@ static PartCollectorData *collect_parts(GMimeMessage *message) {
  *
  */
 static void extract_part(GMimeObject *part, PartExtractorData *a_data) {
-  GMimeDataWrapper *attachment_wrapper = g_mime_part_get_content_object (GMIME_PART(part));
-  GMimeStream *attachment_mem_stream = g_mime_stream_mem_new();
-  g_mime_stream_mem_set_owner(GMIME_STREAM_MEM(attachment_mem_stream), FALSE);
-  g_mime_data_wrapper_write_to_stream(attachment_wrapper, attachment_mem_stream);
-  a_data->content = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(attachment_mem_stream));
-  g_object_unref(attachment_mem_stream);
+  GMimeDataWrapper *content = g_mime_part_get_content_object(GMIME_PART(part));
+  if (content)
+    a_data->content = g_object_ref(content);
 }
 
 
@@ -1209,14 +2084,14 @@ static void part_extractor_foreach_callback(GMimeObject *parent, GMimeObject *pa
  *
  *
  */
-static GByteArray *gmime_message_get_part_data(GMimeMessage* message, guint part_id) {
+static GMimeDataWrapper *gmime_message_get_part_content(GMimeMessage* message, guint part_id) {
   g_return_val_if_fail(message != NULL, NULL);
 
   PartExtractorData *a_data = new_part_extractor_data(part_id);
   g_mime_message_foreach(message, part_extractor_foreach_callback, a_data);
 
-  GByteArray *content = a_data->content;
-  free_part_extractor_data(a_data, FALSE);
+  GMimeDataWrapper *content = a_data->content;
+  free_part_extractor_data(a_data);
 
   if (!content)
     g_printerr("could not locate partId %d\r\n", part_id);
@@ -1225,401 +2100,2034 @@ static GByteArray *gmime_message_get_part_data(GMimeMessage* message, guint part
 }
 
 
-
+// Returned instead of -1 when the part was found but the output failed
+#define PART_WRITE_FAILED -2
 
 
 /*
  *
  *
  */
-static void collect_addresses_into(InternetAddressList *ilist, AddressesList *addr_list, guint size) {
-  g_return_if_fail(ilist != NULL);
-  g_return_if_fail(addr_list != NULL);
-  g_return_if_fail(size != 0);
+static gssize gmime_message_write_part(GMimeMessage* message, guint part_id, GMimeStream *output) {
+  g_return_val_if_fail(output != NULL, -1);
 
-  guint i;
-  for (i = 0; i < size; i++) {
-    InternetAddress *address = internet_address_list_get_address(ilist, i); // transfer none
+  GMimeDataWrapper *content = gmime_message_get_part_content(message, part_id);
+  if (!content)
+    return -1;
 
-    if (INTERNET_ADDRESS_IS_GROUP(address)) {
-      InternetAddressGroup *group = INTERNET_ADDRESS_GROUP(address);
-      InternetAddressList *group_list = internet_address_group_get_members(group); // transer none
+  gssize written = g_mime_data_wrapper_write_to_stream(content, output);
+  g_object_unref(content);
 
-      if (group_list) {
-        guint gsize = internet_address_list_length(group_list);
-        if (gsize)
-          collect_addresses_into(group_list, addr_list, gsize);
-      }
+  return written < 0 ? PART_WRITE_FAILED : written;
+}
 
-    } else if (INTERNET_ADDRESS_IS_MAILBOX(address)) {
-      InternetAddressMailbox *mailbox = INTERNET_ADDRESS_MAILBOX(address);
-      const gchar *name    = internet_address_get_name(address);
-      const gchar *address = internet_address_mailbox_get_addr(mailbox);
-      Address *addr = new_address(address, name);
-      addresses_list_add(addr_list, addr);
-    }
-  }
+
+/*
+ * PART STRUCTURE
+ *
+ * The structure of a message is recorded in the index as one line per leaf
+ * part, in partId order:
+ *
+ *   <partId> TAB <offset> TAB <length> TAB <encoding> TAB <content type> TAB <charset>
+ *
+ * Offsets refer to the message file whose state was recorded along with it.
+ */
+static void structure_append_field(GString *structure, const gchar *value) {
+  g_string_append_c(structure, '\t');
+
+  for (; value && *value; value++)
+    g_string_append_c(structure, (*value == '\t' || *value == '\n' || *value == '\r') ? ' ' : *value);
 }
 
 
+static void structure_foreach_callback(GMimeObject *parent, GMimeObject *part, gpointer user_data) {
+  StructureBuilderData *sdata = (StructureBuilderData *) user_data;
 
-static AddressesList *collect_str_addresses(const gchar* addresses_list_str) {
-  g_return_val_if_fail(addresses_list_str != NULL, NULL);
+  if (GMIME_IS_MESSAGE_PART(part)) {
 
-  AddressesList* result = NULL;
-  InternetAddressList *addresses = internet_address_list_parse_string(addresses_list_str); // transfer-FULL
+    if (sdata->recursion_depth < RECURSION_LIMIT) {
+      GMimeMessage *message = g_mime_message_part_get_message((GMimeMessagePart *) part); // transfer none
+      if (message)
+        g_mime_message_foreach(message, structure_foreach_callback, sdata);
 
-  if (addresses) {
-    guint addresses_length = internet_address_list_length(addresses);
-    if (addresses_length) {
-      result = new_addresses_list();
-      collect_addresses_into(addresses, result, addresses_length);
+    } else {
+      sdata->complete = FALSE;
+      return;
     }
-    g_object_unref(addresses);
+
+  } else if (GMIME_IS_MESSAGE_PARTIAL(part)) {
+    // Not extracted either
+  } else if (GMIME_IS_MULTIPART(part)) {
+    // Nothing special needed on multipart, let descend further
+  } else if (GMIME_IS_PART(part)) {
+    GMimeDataWrapper *wrapper = g_mime_part_get_content_object(GMIME_PART(part));
+    GMimeStream *stream = wrapper ? g_mime_data_wrapper_get_stream(wrapper) : NULL;
+
+    // Content copied out of the file by the parser has no location within it
+    if (!stream || !GMIME_IS_STREAM_MMAP(stream) || stream->bound_start < 0 || stream->bound_end < stream->bound_start) {
+      sdata->complete = FALSE;
+
+    } else {
+      GMimeContentType *content_type = g_mime_object_get_content_type(part);
+      gchar *content_type_str = g_mime_content_type_to_string(content_type);
+      const gchar *encoding = g_mime_content_encoding_to_string(g_mime_data_wrapper_get_encoding(wrapper));
+
+      g_string_append_printf(sdata->structure, "%u\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT,
+                             sdata->part_id, stream->bound_start, stream->bound_end - stream->bound_start);
+      structure_append_field(sdata->structure, encoding ? encoding : "default");
+      structure_append_field(sdata->structure, content_type_str);
+      structure_append_field(sdata->structure, g_mime_content_type_get_parameter(content_type, "charset"));
+      g_string_append_c(sdata->structure, '\n');
+
+      g_free(content_type_str);
+    }
+
+    sdata->part_id++;
+
+  } else {
+    g_assert_not_reached();
   }
-  return result;
 }
 
 
-static AddressesList *collect_addresses(InternetAddressList *list) {
-  g_return_val_if_fail(list != NULL, NULL);
+static gchar *gmime_message_structure(GMimeMessage *message) {
+  g_return_val_if_fail(message != NULL, NULL);
 
-  AddressesList* result = NULL;
-  guint size = internet_address_list_length(list);
-  if (size) {
-    result = new_addresses_list();
-    collect_addresses_into(list, result, size);
-  }
-  return result;
+  StructureBuilderData sdata = { 0, 0, g_string_new(NULL), TRUE };
+  g_mime_message_foreach(message, structure_foreach_callback, &sdata);
+
+  return g_string_free(sdata.structure, !sdata.complete);
 }
 
 
-// Can there be multiple from addresses??
-static Address *get_from_address(GMimeMessage *message) {
-  Address *addr = NULL;
-  const gchar *from_str = g_mime_message_get_sender(message);
-  if (from_str) {
-    AddressesList *addresses_list = collect_str_addresses(from_str);
-    if (addresses_list) {
-      addr = addresses_list_get(addresses_list, 0);
+static PartLocation *part_location_from_structure(const gchar *structure, guint part_id) {
+  PartLocation *loc = NULL;
+  gchar **lines = g_strsplit(structure, "\n", -1);
+
+  guint i;
+  for (i = 0; lines[i] && !loc; i++) {
+    gchar **fields = g_strsplit(lines[i], "\t", 6);
+
+    if (g_strv_length(fields) == 6 && g_ascii_strtoull(fields[0], NULL, 10) == part_id) {
+      loc = g_malloc(sizeof(PartLocation));
+      loc->part_id      = part_id;
+      loc->offset       = g_ascii_strtoll(fields[1], NULL, 10);
+      loc->length       = g_ascii_strtoll(fields[2], NULL, 10);
+      loc->encoding     = g_mime_content_encoding_from_string(fields[3]);
+      loc->content_type = g_strdup(fields[4]);
+      loc->charset      = *fields[5] ? g_strdup(fields[5]) : NULL;
     }
+
+    g_strfreev(fields);
   }
-  return addr;
+
+  g_strfreev(lines);
+  return loc;
 }
 
 
-static AddressesList *get_reply_to_addresses(GMimeMessage *message) {
-  const gchar *reply_to_string = g_mime_message_get_reply_to(message); // transfer-none
-  if (reply_to_string)
-    return collect_str_addresses(reply_to_string);
-  return NULL;
-}
+/*
+ * Maildir filenames are "<unique name>:2,<flags>". The unique name stays the
+ * same while clients move the file from new/ to cur/ and change its flags.
+ */
+static gchar *maildir_unique_name(const gchar *path) {
+  gchar *filename = g_path_get_basename(path);
+  gchar *info = strchr(filename, ':');
 
+  if (info && info != filename)
+    *info = '\0';
 
-static AddressesList *get_to_addresses(GMimeMessage *message) {
-  InternetAddressList *recipients_to = g_mime_message_get_recipients(message, GMIME_RECIPIENT_TYPE_TO); // transfer-none
-  if (recipients_to)
-    return collect_addresses(recipients_to);
-  return NULL;
+  return filename;
 }
 
 
-static AddressesList *get_cc_addresses(GMimeMessage *message) {
-  InternetAddressList *recipients_cc = g_mime_message_get_recipients(message, GMIME_RECIPIENT_TYPE_CC); // transfer-none
-  if (recipients_cc)
-    return collect_addresses(recipients_cc);
+static gchar *maildir_flags(const gchar *path) {
+  const gchar *filename = strrchr(path, '/');
+  filename = filename ? filename + 1 : path;
+
+  const gchar *info = strstr(filename, ":2,");
+  if (info)
+    return g_strdup(info + 3);
+
   return NULL;
 }
 
 
-static AddressesList *get_bcc_addresses(GMimeMessage *message) {
-  InternetAddressList *recipients_bcc = g_mime_message_get_recipients(message, GMIME_RECIPIENT_TYPE_BCC); // transfer-none
-  if (recipients_bcc)
-    return collect_addresses(recipients_bcc);
-  return NULL;
+
+/*
+ * The state of a message file as recorded in the index, telling whether the
+ * file changed since it was indexed.
+ */
+static gchar *file_state_for(const struct stat *st) {
+  return g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT,
+                         (guint64) st->st_ino, (guint64) st->st_size, (gint64) st->st_mtime);
 }
 
 
-static MessageBody* get_body(CollectedPart *body_part, GPtrArray *inlines) {
-  g_return_val_if_fail(body_part != NULL, NULL);
+/*
+ * Messages of a mailbox live in its cur/ or new/ directory. Nested maildirs
+ * share the index of the mailbox they were walked from, so this returns the
+ * directory of the given name within the nearest mailbox holding one.
+ */
+static gchar *mailbox_directory_for_message(const gchar *message_path, const gchar *name) {
+  gchar *dir;
 
-  MessageBody *mb = new_message_body();
+  // Relative paths are made absolute, so the walk up is not stopped at "."
+  if (g_path_is_absolute(message_path)) {
+    dir = g_path_get_dirname(message_path);
+  } else {
+    gchar *cwd = g_get_current_dir();
+    gchar *absolute_path = g_build_filename(cwd, message_path, NULL);
+    dir = g_path_get_dirname(absolute_path);
+    g_free(absolute_path);
+    g_free(cwd);
+  }
 
-  // We keep the raw size intentionally
-  mb->size = body_part->content->len;
-  mb->content_type = g_strdup(body_part->content_type);
+  gchar *dir_name = g_path_get_basename(dir);
+  gchar *directory = NULL;
 
-  // Parse any HTML tags
-  GString *raw_content = g_string_new_len((const gchar*) body_part->content->data, body_part->content->len);
-  GumboOutput* output = gumbo_parse_with_options(&kGumboDefaultOptions, raw_content->str, raw_content->len);
+  if (!strcmp(dir_name, "cur") || !strcmp(dir_name, "new")) {
+    gchar *mailbox_path = g_path_get_dirname(dir);
 
-  // Get a text preview without those HTML tags
-  GString *text_preview = textize(output->root);
+    while (!directory) {
+      directory = g_strjoin("/", mailbox_path, name, NULL);
+      if (!g_file_test(directory, G_FILE_TEST_IS_DIR)) {
+        g_free(directory);
+        directory = NULL;
 
-  if (text_preview->len > MAX_PREVIEW_LENGTH)
-    g_string_truncate(text_preview, MAX_PREVIEW_LENGTH);
+        gchar *parent_path = g_path_get_dirname(mailbox_path);
+        gboolean at_top = !strcmp(parent_path, mailbox_path);
+        g_free(mailbox_path);
+        mailbox_path = parent_path;
+        if (at_top)
+          break;
+      }
+    }
 
-  mb->preview = text_preview->str;
-  g_string_free(text_preview, FALSE);
+    g_free(mailbox_path);
+  }
 
-  // Remove unallowed HTML tags (like scripts, bad href etc..)
-  GString *sanitized_content = sanitize(output->document, inlines);
-  mb->content = sanitized_content->str;
-  g_string_free(sanitized_content, FALSE);
+  g_free(dir_name);
+  g_free(dir);
+  return directory;
+}
 
-  gumbo_destroy_output(&kGumboDefaultOptions, output);
-  g_string_free(raw_content, TRUE);
 
-  return mb;
+static gchar *index_path_for_message(const gchar *message_path) {
+  return mailbox_directory_for_message(message_path, INDEX_DIRECTORY_NAME);
 }
 
 
-static gchar *guess_content_type_extension(const gchar *content_type) {
-  g_return_val_if_fail(content_type != NULL, NULL);
+/*
+ * Looks the part up in the structure recorded for the message file, as long
+ * as the file is still the one that was indexed.
+ */
+static PartLocation *indexed_part_location(const gchar *path, guint part_id) {
+  gchar *index_path = index_path_for_message(path);
+  if (!index_path)
+    return NULL;
 
-  gchar *extension = "txt";
-  if (!g_ascii_strcasecmp(content_type, "text/plain")) {
-    extension = "txt";
-  } else if (!g_ascii_strcasecmp(content_type, "text/html")) {
-    extension = "html";
-  } else if (!g_ascii_strcasecmp(content_type, "text/rtf")) {
-    extension = "rtf";
-  } else if (!g_ascii_strcasecmp(content_type, "text/enriched")) {
-    extension = "etf";
-  } else if (!g_ascii_strcasecmp(content_type, "text/calendar")) {
-    extension = "ics";
-  } else if (!g_ascii_strcasecmp(content_type, "image/jpeg") ||
-             !g_ascii_strcasecmp(content_type, "image/jpg")) {
-    extension = "jpg";
-  } else if (!g_ascii_strcasecmp(content_type, "image/pjpeg")) {
-    extension = "pjpg";
-  } else if (!g_ascii_strcasecmp(content_type, "image/gif")) {
-    extension = "gif";
-  } else if (!g_ascii_strcasecmp(content_type, "image/png") ||
-             !g_ascii_strcasecmp(content_type, "image/x-png")) {
-    extension = "png";
-  } else if (!g_ascii_strcasecmp(content_type, "image/bmp")) {
-    extension = "bmp";
+  PartLocation *loc = NULL;
+  struct stat st;
+
+  if (!stat(path, &st)) {
+    gchar *unique_name = maildir_unique_name(path);
+    gchar *file_state = file_state_for(&st);
+    gchar *structure = xapian_document_structure(index_path, unique_name, file_state);
+
+    if (structure) {
+      loc = part_location_from_structure(structure, part_id);
+      free(structure);
+    }
+
+    // The recorded range must lie within the file as it is now
+    if (loc && (loc->offset < 0 || loc->length < 0 || loc->offset + loc->length > st.st_size)) {
+      free_part_location(loc);
+      loc = NULL;
+    }
+
+    g_free(file_state);
+    g_free(unique_name);
   }
-  return extension;
+
+  g_free(index_path);
+  return loc;
 }
 
 
-static gchar *filename_for(CollectedPart *part) {
-  if (part->filename)
-    return g_strdup(part->filename);
+static GMimeStream *located_part_stream(const gchar *path, PartLocation *loc) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
 
-  if (part->content_id) {
-    if (gc_contains_c(part->content_id, '.'))
-      return g_strjoin(NULL, "_", part->content_id, NULL);
-    return g_strjoin(NULL, "_", part->content_id, ".", guess_content_type_extension(part->content_type), NULL);
-  }
-  return g_strjoin(NULL, "_unnamed", ".", guess_content_type_extension(part->content_type), NULL);
+  // The stream owns the descriptor, and reads only the encoded content
+  return g_mime_stream_fs_new_with_bounds(fd, loc->offset, loc->offset + loc->length);
 }
 
 
-static void add_attachments_from_parts(MessageAttachmentsList *list, GPtrArray *att_parts) {
-  g_return_if_fail((att_parts != NULL) && (list != NULL));
-  g_return_if_fail(att_parts->len > 0);
+static gssize write_located_part(const gchar *path, PartLocation *loc, GMimeStream *output) {
+  GMimeStream *content_stream = located_part_stream(path, loc);
+  if (!content_stream)
+    return -1;
 
-  guint i;
-  for (i = 0; i < att_parts->len; i++) {
-    CollectedPart *att_part = g_ptr_array_index(att_parts, i);
-    MessageAttachment *attachment = new_message_attachment(att_part->part_id);
-    attachment->content_type = g_strdup(att_part->content_type);
-    attachment->size = att_part->content->len;
-    attachment->filename = filename_for(att_part);
-    message_attachments_list_add(list, attachment);
+  GMimeDataWrapper *wrapper = g_mime_data_wrapper_new_with_stream(content_stream, loc->encoding);
+
+  gssize written = g_mime_data_wrapper_write_to_stream(wrapper, output);
+
+  g_object_unref(wrapper);
+  g_object_unref(content_stream);
+
+  return written < 0 ? PART_WRITE_FAILED : written;
+}
+
+
+/*
+ * Writes the decoded part from its recorded location when the message has
+ * been indexed, and by parsing the message otherwise.
+ */
+static gssize write_part_from_path(const gchar *path, guint part_id, GMimeStream *output) {
+  PartLocation *loc = indexed_part_location(path, part_id);
+  if (loc) {
+    gssize written = write_located_part(path, loc, output);
+    free_part_location(loc);
+    return written;
   }
+
+  GMimeMessage *message = gmime_message_from_path(path);
+  if (!message)
+    return -1;
+
+  gssize written = gmime_message_write_part(message, part_id, output);
+  g_object_unref(message);
+
+  return written;
 }
 
 
+/*
+ * PART RANGES
+ *
+ * A byte range of the decoded content decodes as little of the encoded
+ * content as the transfer encoding allows. Identity encodings map decoded
+ * offsets straight onto encoded ones, base64 maps them onto groups of four
+ * characters as long as all lines share one length, and anything else is
+ * decoded from the start.
+ */
+#define RANGE_READ_SIZE 4096
 
-static MessageAttachmentsList *get_attachments(PartCollectorData *pdata) {
-  g_return_val_if_fail(pdata != NULL, NULL);
-  g_return_val_if_fail((pdata->attachments != NULL) ||
-                       (pdata->inlines != NULL) ||
-                       (pdata->alternative_bodies != NULL), NULL);
 
-  MessageAttachmentsList *att_list = new_message_attachments_list();
+typedef struct Base64Layout {
+  gint64 length;      // of the encoded content, in bytes
+  gint64 line_chars;  // base64 characters per line
+  gint64 line_stride; // bytes per line, including the line terminator
+  gint64 chars;       // base64 characters in total, including padding
+  guint  padding;
+} Base64Layout;
 
-  if (pdata->alternative_bodies && pdata->alternative_bodies->len > 0)
-    add_attachments_from_parts(att_list, pdata->alternative_bodies);
 
-  if (pdata->attachments && pdata->attachments->len > 0)
-    add_attachments_from_parts(att_list, pdata->attachments);
+static gboolean stream_read_at(GMimeStream *stream, gint64 offset, guchar *buffer, gsize len) {
+  if (g_mime_stream_seek(stream, stream->bound_start + offset, GMIME_STREAM_SEEK_SET) < 0)
+    return FALSE;
 
-  if (pdata->inlines && pdata->inlines->len > 0)
-    add_attachments_from_parts(att_list, pdata->inlines);
+  gsize nread = 0;
+  while (nread < len) {
+    gssize n = g_mime_stream_read(stream, (gchar *) buffer + nread, len - nread);
+    if (n <= 0)
+      return FALSE;
+    nread += n;
+  }
 
-  if (att_list->len)
-    return att_list;
+  return TRUE;
+}
 
-  free_message_attachments_list(att_list);
-  return NULL;
+
+static gboolean is_base64_space(guchar c) {
+  return c == '\n' || c == '\r' || c == ' ' || c == '\t';
 }
 
 
+/*
+ * Takes the line length from the first line and the total from the last
+ * one, which is all it takes when the encoder wrapped every line alike.
+ */
+static gboolean base64_layout(GMimeStream *encoded, gint64 length, Base64Layout *layout) {
+  guchar buffer[RANGE_READ_SIZE];
+  gint64 head_len = MIN(length, RANGE_READ_SIZE);
 
-static MessageData *convert_message(GMimeMessage *message, gboolean include_content) {
-  if (!message)
-    return NULL;
+  if (!stream_read_at(encoded, 0, buffer, head_len))
+    return FALSE;
 
-  MessageData *md = new_message_data();
+  guchar *newline = memchr(buffer, '\n', head_len);
+  if (!newline && head_len < length)
+    return FALSE;
+
+  layout->length = length;
+  layout->line_chars = 0;
+  layout->line_stride = 0;
 
-  const gchar *message_id = g_mime_message_get_message_id(message);
-  if (message_id)
-    md->message_id = g_strdup(message_id);
+  if (newline) {
+    layout->line_stride = newline - buffer + 1;
+    layout->line_chars  = newline - buffer - (newline > buffer && newline[-1] == '\r');
+  }
 
-  md->from     = get_from_address(message);
-  md->reply_to = get_reply_to_addresses(message);
-  md->to       = get_to_addresses(message);
-  md->cc       = get_cc_addresses(message);
-  md->bcc      = get_bcc_addresses(message);
+  gint64 tail_start = MAX(0, length - RANGE_READ_SIZE);
+  gint64 tail_len = length - tail_start;
 
-  const gchar *subject = g_mime_message_get_subject(message);
-  if (subject)
-    md->subject = g_strdup(subject);
+  if (!stream_read_at(encoded, tail_start, buffer, tail_len))
+    return FALSE;
 
-  md->date = g_mime_message_get_date_as_string(message);
+  gint64 tail_end = tail_len;
+  while (tail_end > 0 && is_base64_space(buffer[tail_end - 1]))
+    tail_end--;
 
-  const gchar *in_reply_to = g_mime_object_get_header(GMIME_OBJECT (message), "In-reply-to");
-  if (in_reply_to)
-    md->in_reply_to = g_mime_utils_header_decode_text(in_reply_to);
+  gint64 last_line = tail_end;
+  while (last_line > 0 && buffer[last_line - 1] != '\n')
+    last_line--;
 
-  const gchar *references = g_mime_object_get_header(GMIME_OBJECT (message), "References");
-  if (references)
-    md->references = g_mime_utils_header_decode_text(references);
+  if (!last_line && tail_start)
+    return FALSE;
 
-  if (include_content) {
-    PartCollectorData *pc = collect_parts(message);
+  gint64 last_line_start = tail_start + last_line;
+  gint64 last_line_chars = tail_end - last_line;
 
-    if (pc->text_part)
-      md->text = get_body(pc->text_part, NULL);
+  if (!layout->line_stride) {
+    // A single line without terminator
+    layout->line_chars  = last_line_chars;
+    layout->line_stride = last_line_chars + 1;
+  }
 
-    if (pc->html_part)
-      md->html = get_body(pc->html_part, pc->inlines);
+  if (!layout->line_chars || last_line_chars > layout->line_chars || last_line_start % layout->line_stride)
+    return FALSE;
 
-    md->attachments = get_attachments(pc);
+  layout->chars = last_line_start / layout->line_stride * layout->line_chars + last_line_chars;
+  if (layout->chars % 4)
+    return FALSE;
 
-    free_part_collector_data(pc);
+  layout->padding = 0;
+  while (layout->padding < 2 && tail_end > 0 && buffer[tail_end - 1] == '=') {
+    layout->padding++;
+    tail_end--;
   }
 
-  return md;
+  return TRUE;
 }
 
 
+static gint64 base64_char_offset(Base64Layout *layout, gint64 char_index) {
+  gint64 offset = char_index / layout->line_chars * layout->line_stride + char_index % layout->line_chars;
+  return MIN(offset, layout->length);
+}
+
+
+static GByteArray *read_base64_range(GMimeStream *encoded, Base64Layout *layout, gint64 start, gint64 end) {
+  gint64 first_group = start / 3;
+  gint64 from = base64_char_offset(layout, first_group * 4);
+  gint64 to = base64_char_offset(layout, (end + 2) / 3 * 4);
+
+  // The line we start on has to follow a line terminator, or lines differ in length
+  gint64 line_start = from - from % layout->line_stride;
+  guchar terminator;
+  if (line_start > 0 && (!stream_read_at(encoded, line_start - 1, &terminator, 1) || terminator != '\n'))
+    return NULL;
 
-static JSON_Value *address_to_json(Address *addr) {
-  if (!addr)
+  guchar *encoded_buf = g_malloc(to - from + 1);
+  if (!stream_read_at(encoded, from, encoded_buf, to - from)) {
+    g_free(encoded_buf);
     return NULL;
+  }
 
-  JSON_Value *address_value = json_value_init_object();
-  JSON_Object *address_object = json_value_get_object(address_value);
+  GByteArray *range = g_byte_array_sized_new(to - from + 1);
+  g_byte_array_set_size(range, to - from + 1);
 
-  json_object_set_string(address_object, "name",    addr->name);
-  json_object_set_string(address_object, "address", addr->address);
+  int state = 0;
+  guint32 save = 0;
+  gsize decoded = g_mime_encoding_base64_decode_step(encoded_buf, to - from, range->data, &state, &save);
+  g_free(encoded_buf);
+
+  gint64 skip = start - first_group * 3;
+  if ((gint64) decoded < skip + (end - start)) {
+    g_byte_array_free(range, TRUE);
+    return NULL;
+  }
 
-  return address_value;
+  g_byte_array_remove_range(range, 0, skip);
+  g_byte_array_set_size(range, end - start);
+  return range;
 }
 
 
-static JSON_Value *addresses_list_to_json(AddressesList *addr_list) {
-  if (!addr_list)
+static GByteArray *read_range_sequentially(GMimeStream *encoded, GMimeContentEncoding encoding, gint64 start, gint64 end, gint64 *total) {
+  if (g_mime_stream_reset(encoded) < 0)
     return NULL;
 
-  JSON_Value *addreses_value = json_value_init_array();
-  JSON_Array *addresses_ary = json_value_get_array(addreses_value);
+  GMimeStream *decoded = g_mime_stream_filter_new(encoded);
 
-  guint i;
-  for (i = 0; i < addr_list->len; i++) {
-    Address *addr = addresses_list_get(addr_list, i);
-    JSON_Value *jaddr = address_to_json(addr);
-    json_array_append_value(addresses_ary, jaddr);
+  if (encoding == GMIME_CONTENT_ENCODING_BASE64 ||
+      encoding == GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE ||
+      encoding == GMIME_CONTENT_ENCODING_UUENCODE) {
+    GMimeFilter *filter = g_mime_filter_basic_new(encoding, FALSE);
+    g_mime_stream_filter_add(GMIME_STREAM_FILTER(decoded), filter);
+    g_object_unref(filter);
   }
 
-  return addreses_value;
-}
+  GByteArray *range = g_byte_array_new();
+  gchar buffer[RANGE_READ_SIZE];
+  gint64 position = 0;
+  gssize n;
 
+  while ((n = g_mime_stream_read(decoded, buffer, sizeof(buffer))) > 0) {
+    gint64 from = MAX(start, position);
+    gint64 to = end < 0 ? position + n : MIN(end, position + n);
 
-static JSON_Value *message_body_to_json(MessageBody *mbody) {
-  if (!mbody)
+    if (from < to)
+      g_byte_array_append(range, (guint8 *) buffer + (from - position), to - from);
+
+    position += n;
+  }
+
+  g_object_unref(decoded);
+
+  if (n < 0) {
+    g_byte_array_free(range, TRUE);
     return NULL;
+  }
+
+  *total = position;
+  return range;
+}
+
+
+static GByteArray *read_part_range(GMimeStream *encoded, GMimeContentEncoding encoding, gint64 start, gint64 end, gint64 *total) {
+  gint64 length = g_mime_stream_length(encoded);
+  GByteArray *range = NULL;
+  Base64Layout layout = { 0 };
+
+  if (length >= 0) {
+    switch (encoding) {
+      case GMIME_CONTENT_ENCODING_DEFAULT:
+      case GMIME_CONTENT_ENCODING_7BIT:
+      case GMIME_CONTENT_ENCODING_8BIT:
+      case GMIME_CONTENT_ENCODING_BINARY:
+        *total = length;
+        break;
+
+      case GMIME_CONTENT_ENCODING_BASE64:
+        if (!length)
+          *total = 0;
+        else if (base64_layout(encoded, length, &layout))
+          *total = layout.chars / 4 * 3 - layout.padding;
+        else
+          return read_range_sequentially(encoded, encoding, start, end, total);
+        break;
+
+      default:
+        return read_range_sequentially(encoded, encoding, start, end, total);
+    }
 
-  JSON_Value *body_value = json_value_init_object();
-  JSON_Object *body_object = json_value_get_object(body_value);
+    if (end < 0 || end > *total)
+      end = *total;
+    if (start > end)
+      start = end;
 
-  json_object_set_string(body_object, "type",    mbody->content_type);
-  json_object_set_string(body_object, "content", mbody->content);
-  json_object_set_string(body_object, "preview", mbody->preview);
-  json_object_set_number(body_object, "size",    mbody->size);
+    if (start == end)
+      return g_byte_array_new();
 
-  return body_value;
+    if (encoding == GMIME_CONTENT_ENCODING_BASE64) {
+      range = read_base64_range(encoded, &layout, start, end);
+
+    } else {
+      range = g_byte_array_sized_new(end - start);
+      g_byte_array_set_size(range, end - start);
+
+      if (!stream_read_at(encoded, start, range->data, end - start)) {
+        g_byte_array_free(range, TRUE);
+        range = NULL;
+      }
+    }
+  }
+
+  if (!range)
+    range = read_range_sequentially(encoded, encoding, start, end, total);
+
+  return range;
 }
 
 
 
-static JSON_Value *message_attachments_list_to_json(MessageAttachmentsList *matts) {
-  if (!matts)
-    return NULL;
 
-  JSON_Value *attachments_value = json_value_init_array();
-  JSON_Array *attachments_array = json_value_get_array(attachments_value);
+
+/*
+ *
+ *
+ */
+static void collect_addresses_into(InternetAddressList *ilist, AddressesList *addr_list, guint size) {
+  g_return_if_fail(ilist != NULL);
+  g_return_if_fail(addr_list != NULL);
+  g_return_if_fail(size != 0);
+
   guint i;
-  for (i = 0; i < matts->len; i++) {
-    MessageAttachment *att = message_attachments_list_get(matts, i);
-    JSON_Value  *attachment_value = json_value_init_object();
-    JSON_Object *attachment_object = json_value_get_object(attachment_value);
-    json_object_set_number(attachment_object, "partId",   att->part_id);
-    json_object_set_string(attachment_object, "type",     att->content_type);
-    json_object_set_string(attachment_object, "filename", att->filename);
-    json_object_set_number(attachment_object, "size",     att->size);
-    json_array_append_value(attachments_array, attachment_value);
+  for (i = 0; i < size; i++) {
+    InternetAddress *address = internet_address_list_get_address(ilist, i); // transfer none
+
+    if (INTERNET_ADDRESS_IS_GROUP(address)) {
+      InternetAddressGroup *group = INTERNET_ADDRESS_GROUP(address);
+      InternetAddressList *group_list = internet_address_group_get_members(group); // transer none
+
+      if (group_list) {
+        guint gsize = internet_address_list_length(group_list);
+        if (gsize)
+          collect_addresses_into(group_list, addr_list, gsize);
+      }
+
+    } else if (INTERNET_ADDRESS_IS_MAILBOX(address)) {
+      InternetAddressMailbox *mailbox = INTERNET_ADDRESS_MAILBOX(address);
+      const gchar *name    = internet_address_get_name(address);
+      const gchar *address = internet_address_mailbox_get_addr(mailbox);
+      Address *addr = new_address(address, name);
+      addresses_list_add(addr_list, addr);
+    }
+  }
+}
+
+
+
+static AddressesList *collect_str_addresses(const gchar* addresses_list_str) {
+  g_return_val_if_fail(addresses_list_str != NULL, NULL);
+
+  AddressesList* result = NULL;
+  InternetAddressList *addresses = internet_address_list_parse_string(addresses_list_str); // transfer-FULL
+
+  if (addresses) {
+    guint addresses_length = internet_address_list_length(addresses);
+    if (addresses_length) {
+      result = new_addresses_list();
+      collect_addresses_into(addresses, result, addresses_length);
+    }
+    g_object_unref(addresses);
   }
-  return attachments_value;
+  return result;
+}
+
+
+static AddressesList *collect_addresses(InternetAddressList *list) {
+  g_return_val_if_fail(list != NULL, NULL);
+
+  AddressesList* result = NULL;
+  guint size = internet_address_list_length(list);
+  if (size) {
+    result = new_addresses_list();
+    collect_addresses_into(list, result, size);
+  }
+  return result;
+}
+
+
+// Can there be multiple from addresses??
+static Address *get_from_address(GMimeMessage *message) {
+  Address *addr = NULL;
+  const gchar *from_str = g_mime_message_get_sender(message);
+  if (from_str) {
+    AddressesList *addresses_list = collect_str_addresses(from_str);
+    if (addresses_list) {
+      addr = addresses_list_get(addresses_list, 0);
+    }
+  }
+  return addr;
+}
+
+
+static AddressesList *get_reply_to_addresses(GMimeMessage *message) {
+  const gchar *reply_to_string = g_mime_message_get_reply_to(message); // transfer-none
+  if (reply_to_string)
+    return collect_str_addresses(reply_to_string);
+  return NULL;
+}
+
+
+static AddressesList *get_to_addresses(GMimeMessage *message) {
+  InternetAddressList *recipients_to = g_mime_message_get_recipients(message, GMIME_RECIPIENT_TYPE_TO); // transfer-none
+  if (recipients_to)
+    return collect_addresses(recipients_to);
+  return NULL;
+}
+
+
+static AddressesList *get_cc_addresses(GMimeMessage *message) {
+  InternetAddressList *recipients_cc = g_mime_message_get_recipients(message, GMIME_RECIPIENT_TYPE_CC); // transfer-none
+  if (recipients_cc)
+    return collect_addresses(recipients_cc);
+  return NULL;
+}
+
+
+static AddressesList *get_bcc_addresses(GMimeMessage *message) {
+  InternetAddressList *recipients_bcc = g_mime_message_get_recipients(message, GMIME_RECIPIENT_TYPE_BCC); // transfer-none
+  if (recipients_bcc)
+    return collect_addresses(recipients_bcc);
+  return NULL;
+}
+
+
+static gboolean get_plain_body(CollectedPart *body_part, SanitizerContext *ctx, ConvertMode mode, guint body_fields, MessageBody *mb) {
+  const gchar *filtered = (const gchar *) body_part->content->data;
+  gsize len = body_part->content->len;
+
+  if (mode == CONVERT_INDEXING) {
+    GString *text_content = g_string_new(NULL);
+    if (!plain_html_convert(filtered, len, ctx, NULL, text_content, 0)) {
+      g_string_free(text_content, TRUE);
+      return FALSE;
+    }
+
+    mb->content = g_string_free(text_content, FALSE);
+    return TRUE;
+  }
+
+  GString *text_preview = NULL;
+  if (body_fields & JSON_BODY_PREVIEW)
+    text_preview = g_string_new(NULL);
+
+  GString *sanitized_content = NULL;
+  if (body_fields & JSON_BODY_CONTENT)
+    sanitized_content = g_string_sized_new(len + len / 8);
+
+  if (!plain_html_convert(filtered, len, ctx, sanitized_content, text_preview, MAX_PREVIEW_LENGTH)) {
+    if (text_preview)
+      g_string_free(text_preview, TRUE);
+    if (sanitized_content)
+      g_string_free(sanitized_content, TRUE);
+    return FALSE;
+  }
+
+  if (text_preview) {
+    gstr_truncate_utf8(text_preview, MAX_PREVIEW_LENGTH);
+    mb->preview = g_string_free(text_preview, FALSE);
+  }
+  if (sanitized_content)
+    mb->content = g_string_free(sanitized_content, FALSE);
+  return TRUE;
+}
+
+
+/*
+ * BODY CACHE
+ *
+ * The same newsletter arrives in many mailboxes. Converted bodies are kept
+ * in memory, shared across messages and threads, keyed by a SHA-256 of all
+ * their conversion depends on: the decoded body, the requested fields and
+ * the inlines its cid: URLs may refer to. The least recently used ones are
+ * dropped beyond BODY_CACHE_MAX_SIZE. Small bodies are quicker to convert
+ * again than to hash.
+ */
+#define BODY_CACHE_MIN_SIZE 4096
+#define BODY_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+
+typedef struct BodyCacheEntry {
+  gchar *key;
+  gchar *content;
+  gchar *preview;
+  gsize size;   // memory taken by the strings
+  GList *link;  // within body_cache_lru, most recently used first
+} BodyCacheEntry;
+
+
+static GHashTable *body_cache      = NULL;
+static GQueue     body_cache_lru   = G_QUEUE_INIT;
+static gsize      body_cache_size  = 0;
+static GMutex     body_cache_lock;
+
+
+static void free_body_cache_entry(gpointer data) {
+  BodyCacheEntry *entry = data;
+  g_free(entry->key);
+  g_free(entry->content);
+  g_free(entry->preview);
+  g_free(entry);
+}
+
+
+static void build_body_cache(void) {
+  body_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_body_cache_entry);
+}
+
+
+static void free_body_cache(void) {
+  g_mutex_lock(&body_cache_lock);
+  g_hash_table_destroy(body_cache);
+  g_queue_clear(&body_cache_lru);
+  body_cache      = NULL;
+  body_cache_size = 0;
+  g_mutex_unlock(&body_cache_lock);
+}
+
+
+/*
+ * Identifies an inline without decoding it: by its partId when referenced
+ * by URL, and otherwise by its content type, encoding and encoded content,
+ * which decodes to the same data URI.
+ */
+static void body_cache_checksum_inline(GChecksum *checksum, CollectedPart *inline_part, const gchar *cid_url_template) {
+  if (cid_url_template) {
+    gchar part_id_str[16];
+    g_snprintf(part_id_str, sizeof(part_id_str), "%u", inline_part->part_id);
+    g_checksum_update(checksum, (const guchar *) part_id_str, strlen(part_id_str) + 1);
+    return;
+  }
+
+  gchar *settings = g_strdup_printf("%s:%d", inline_part->content_type ? inline_part->content_type : "",
+                                    inline_part->undecoded ? 1 : 0);
+  g_checksum_update(checksum, (const guchar *) settings, strlen(settings) + 1);
+  g_free(settings);
+
+  if (inline_part->mime_part) {
+    GMimeDataWrapper *wrapper = g_mime_part_get_content_object(GMIME_PART(inline_part->mime_part));
+    GMimeStream *encoded = wrapper ? g_mime_data_wrapper_get_stream(wrapper) : NULL;
+
+    if (encoded) {
+      gchar encoding[16];
+      g_snprintf(encoding, sizeof(encoding), "%d", g_mime_data_wrapper_get_encoding(wrapper));
+      g_checksum_update(checksum, (const guchar *) encoding, strlen(encoding) + 1);
+
+      // Decoding rewinds the stream on its own, so reading it here is harmless
+      gchar buffer[4096];
+      gssize n_read;
+      g_mime_stream_reset(encoded);
+      while ((n_read = g_mime_stream_read(encoded, buffer, sizeof(buffer))) > 0)
+        g_checksum_update(checksum, (const guchar *) buffer, n_read);
+      g_mime_stream_reset(encoded);
+    }
+
+  } else if (inline_part->content) {
+    g_checksum_update(checksum, (const guchar *) "decoded", 8);
+    g_checksum_update(checksum, inline_part->content->data, inline_part->content->len);
+  }
+}
+
+
+static gchar *body_cache_key(CollectedPart *body_part, SanitizerContext *ctx, guint body_fields) {
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+  gchar *settings = g_strdup_printf("%u:%s:%s", body_fields, body_part->content_type,
+                                    ctx->cid_url_template ? ctx->cid_url_template : "");
+  g_checksum_update(checksum, (const guchar *) settings, strlen(settings) + 1);
+  g_free(settings);
+
+  gchar *content_size = g_strdup_printf("%u", body_part->content->len);
+  g_checksum_update(checksum, (const guchar *) content_size, strlen(content_size) + 1);
+  g_checksum_update(checksum, body_part->content->data, body_part->content->len);
+  g_free(content_size);
+
+  // In a stable order, whatever the order of the parts
+  if (ctx->inlines_by_cid) {
+    GList *content_ids = g_list_sort(g_hash_table_get_keys(ctx->inlines_by_cid), (GCompareFunc) strcmp);
+
+    GList *l;
+    for (l = content_ids; l; l = l->next) {
+      const gchar *content_id = l->data;
+      g_checksum_update(checksum, (const guchar *) content_id, strlen(content_id) + 1);
+      body_cache_checksum_inline(checksum, g_hash_table_lookup(ctx->inlines_by_cid, content_id), ctx->cid_url_template);
+    }
+
+    g_list_free(content_ids);
+  }
+
+  gchar *key = g_strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  return key;
+}
+
+
+static gboolean body_cache_lookup(const gchar *key, MessageBody *mb) {
+  g_mutex_lock(&body_cache_lock);
+
+  BodyCacheEntry *entry = body_cache ? g_hash_table_lookup(body_cache, key) : NULL;
+  if (entry) {
+    g_queue_unlink(&body_cache_lru, entry->link);
+    g_queue_push_head_link(&body_cache_lru, entry->link);
+
+    mb->content = g_strdup(entry->content);
+    mb->preview = g_strdup(entry->preview);
+  }
+
+  g_mutex_unlock(&body_cache_lock);
+  return entry != NULL;
+}
+
+
+static void body_cache_store(gchar *key, MessageBody *mb) {
+  gsize size = (mb->content ? strlen(mb->content) : 0) + (mb->preview ? strlen(mb->preview) : 0);
+
+  // A single body should not push out everything else
+  if (size > BODY_CACHE_MAX_SIZE / 8) {
+    g_free(key);
+    return;
+  }
+
+  g_mutex_lock(&body_cache_lock);
+
+  // Another thread may have converted the same body meanwhile
+  if (!body_cache || g_hash_table_contains(body_cache, key)) {
+    g_mutex_unlock(&body_cache_lock);
+    g_free(key);
+    return;
+  }
+
+  BodyCacheEntry *entry = g_malloc(sizeof(BodyCacheEntry));
+  entry->key     = key;
+  entry->content = g_strdup(mb->content);
+  entry->preview = g_strdup(mb->preview);
+  entry->size    = size;
+
+  g_queue_push_head(&body_cache_lru, entry);
+  entry->link = body_cache_lru.head;
+  g_hash_table_insert(body_cache, entry->key, entry);
+  body_cache_size += size;
+
+  while (body_cache_size > BODY_CACHE_MAX_SIZE) {
+    BodyCacheEntry *oldest = g_queue_pop_tail(&body_cache_lru);
+    body_cache_size -= oldest->size;
+    g_hash_table_remove(body_cache, oldest->key);
+  }
+
+  g_mutex_unlock(&body_cache_lock);
+}
+
+
+/*
+ * Converts a body into those of the JSON_BODY_* fields which are asked for;
+ * indexing always needs the complete text.
+ */
+static void convert_body(CollectedPart *body_part, SanitizerContext *ctx, ConvertMode mode, guint body_fields, MessageBody *mb) {
+  if (budget_out_of_time(ctx->budget))
+    return;
+
+  // Plain text went through the GMime HTML filter, whose output needs no parsing
+  if (g_str_has_prefix(body_part->content_type, "text/plain") && get_plain_body(body_part, ctx, mode, body_fields, mb))
+    return;
+
+  // Gumbo gets at most max_html_bytes, cut at a character boundary
+  const gchar *html = (const gchar *) body_part->content->data;
+  gsize html_len = body_part->content->len;
+
+  const JMimeLimits *limits = ctx->budget ? ctx->budget->limits : NULL;
+  if (limits && limits->max_html_bytes && html_len > limits->max_html_bytes) {
+    html_len = limits->max_html_bytes;
+    while (html_len && ((guchar) html[html_len] & 0xC0) == 0x80)
+      html_len--;
+    ctx->budget->truncated = TRUE;
+  }
+
+  // Parse any HTML tags
+  GString *raw_content = g_string_new_len(html, html_len);
+  GumboOutput* output = gumbo_parse_with_options(&kGumboDefaultOptions, raw_content->str, raw_content->len);
+
+  if (mode == CONVERT_INDEXING) {
+    // Indexing needs all of the visible text, but neither markup nor inlines
+    GString *text_content = textize(output->root, 0, ctx->budget);
+    mb->content = text_content->str;
+    g_string_free(text_content, FALSE);
+
+  } else {
+    // Get a text preview without those HTML tags
+    if (body_fields & JSON_BODY_PREVIEW) {
+      GString *text_preview = textize(output->root, MAX_PREVIEW_LENGTH, ctx->budget);
+
+      mb->preview = text_preview->str;
+      g_string_free(text_preview, FALSE);
+    }
+
+    // Remove unallowed HTML tags (like scripts, bad href etc..)
+    if (body_fields & JSON_BODY_CONTENT) {
+      GString *sanitized_content = g_string_sized_new(raw_content->len);
+      sanitize(output->document, ctx, sanitized_content);
+      mb->content = sanitized_content->str;
+      g_string_free(sanitized_content, FALSE);
+    }
+  }
+
+  gumbo_destroy_output(&kGumboDefaultOptions, output);
+  g_string_free(raw_content, TRUE);
+}
+
+
+static MessageBody* get_body(CollectedPart *body_part, SanitizerContext *ctx, ConvertMode mode, guint body_fields) {
+  g_return_val_if_fail(body_part != NULL, NULL);
+
+  MessageBody *mb = new_message_body();
+
+  // We keep the raw size intentionally
+  mb->size = body_part->content->len;
+  mb->content_type = g_strdup(body_part->content_type);
+
+  if (mode != CONVERT_INDEXING && !(body_fields & (JSON_BODY_CONTENT | JSON_BODY_PREVIEW)))
+    return mb;
+
+  if (mode != CONVERT_FULL || body_part->content->len < BODY_CACHE_MIN_SIZE) {
+    convert_body(body_part, ctx, mode, body_fields, mb);
+    return mb;
+  }
+
+  gchar *key = body_cache_key(body_part, ctx, body_fields);
+  if (body_cache_lookup(key, mb)) {
+    g_free(key);
+    return mb;
+  }
+
+  // Bodies converted within a budget that ran out may be incomplete
+  convert_body(body_part, ctx, mode, body_fields, mb);
+  if (!ctx->budget || !ctx->budget->truncated)
+    body_cache_store(key, mb);
+  else
+    g_free(key);
+  return mb;
+}
+
+
+static gchar *guess_content_type_extension(const gchar *content_type) {
+  g_return_val_if_fail(content_type != NULL, NULL);
+
+  gchar *extension = "txt";
+  if (!g_ascii_strcasecmp(content_type, "text/plain")) {
+    extension = "txt";
+  } else if (!g_ascii_strcasecmp(content_type, "text/html")) {
+    extension = "html";
+  } else if (!g_ascii_strcasecmp(content_type, "text/rtf")) {
+    extension = "rtf";
+  } else if (!g_ascii_strcasecmp(content_type, "text/enriched")) {
+    extension = "etf";
+  } else if (!g_ascii_strcasecmp(content_type, "text/calendar")) {
+    extension = "ics";
+  } else if (!g_ascii_strcasecmp(content_type, "image/jpeg") ||
+             !g_ascii_strcasecmp(content_type, "image/jpg")) {
+    extension = "jpg";
+  } else if (!g_ascii_strcasecmp(content_type, "image/pjpeg")) {
+    extension = "pjpg";
+  } else if (!g_ascii_strcasecmp(content_type, "image/gif")) {
+    extension = "gif";
+  } else if (!g_ascii_strcasecmp(content_type, "image/png") ||
+             !g_ascii_strcasecmp(content_type, "image/x-png")) {
+    extension = "png";
+  } else if (!g_ascii_strcasecmp(content_type, "image/bmp")) {
+    extension = "bmp";
+  }
+  return extension;
+}
+
+
+static gchar *filename_for(CollectedPart *part) {
+  if (part->filename)
+    return g_strdup(part->filename);
+
+  if (part->content_id) {
+    if (gc_contains_c(part->content_id, '.'))
+      return g_strjoin(NULL, "_", part->content_id, NULL);
+    return g_strjoin(NULL, "_", part->content_id, ".", guess_content_type_extension(part->content_type), NULL);
+  }
+  return g_strjoin(NULL, "_unnamed", ".", guess_content_type_extension(part->content_type), NULL);
+}
+
+
+static void add_attachments_from_parts(MessageAttachmentsList *list, GPtrArray *att_parts) {
+  g_return_if_fail((att_parts != NULL) && (list != NULL));
+  g_return_if_fail(att_parts->len > 0);
+
+  guint i;
+  for (i = 0; i < att_parts->len; i++) {
+    CollectedPart *att_part = g_ptr_array_index(att_parts, i);
+    MessageAttachment *attachment = new_message_attachment(att_part->part_id);
+    attachment->content_type = g_strdup(att_part->content_type);
+    attachment->size = att_part->size;
+    attachment->undecoded = att_part->undecoded;
+    attachment->filename = filename_for(att_part);
+    message_attachments_list_add(list, attachment);
+  }
+}
+
+
+
+static MessageAttachmentsList *get_attachments(PartCollectorData *pdata) {
+  g_return_val_if_fail(pdata != NULL, NULL);
+  g_return_val_if_fail((pdata->attachments != NULL) ||
+                       (pdata->inlines != NULL) ||
+                       (pdata->alternative_bodies != NULL), NULL);
+
+  MessageAttachmentsList *att_list = new_message_attachments_list();
+
+  if (pdata->alternative_bodies && pdata->alternative_bodies->len > 0)
+    add_attachments_from_parts(att_list, pdata->alternative_bodies);
+
+  if (pdata->attachments && pdata->attachments->len > 0)
+    add_attachments_from_parts(att_list, pdata->attachments);
+
+  if (pdata->inlines && pdata->inlines->len > 0)
+    add_attachments_from_parts(att_list, pdata->inlines);
+
+  if (att_list->len)
+    return att_list;
+
+  free_message_attachments_list(att_list);
+  return NULL;
+}
+
+
+
+typedef struct JsonFieldName {
+  const gchar *name;
+  guint       fields;
+} JsonFieldName;
+
+
+static const JsonFieldName json_field_names[] = {
+  { "from",         JSON_FIELD_FROM },
+  { "to",           JSON_FIELD_TO },
+  { "replyTo",      JSON_FIELD_REPLY_TO },
+  { "cc",           JSON_FIELD_CC },
+  { "bcc",          JSON_FIELD_BCC },
+  { "messageId",    JSON_FIELD_MESSAGE_ID },
+  { "subject",      JSON_FIELD_SUBJECT },
+  { "date",         JSON_FIELD_DATE },
+  { "inReplyTo",    JSON_FIELD_IN_REPLY_TO },
+  { "references",   JSON_FIELD_REFERENCES },
+  { "attachments",  JSON_FIELD_ATTACHMENTS },
+  { "text",         JSON_FIELD_TEXT(JSON_BODY_ALL) },
+  { "text.type",    JSON_FIELD_TEXT(JSON_BODY_TYPE) },
+  { "text.content", JSON_FIELD_TEXT(JSON_BODY_CONTENT) },
+  { "text.preview", JSON_FIELD_TEXT(JSON_BODY_PREVIEW) },
+  { "text.size",    JSON_FIELD_TEXT(JSON_BODY_SIZE) },
+  { "html",         JSON_FIELD_HTML(JSON_BODY_ALL) },
+  { "html.type",    JSON_FIELD_HTML(JSON_BODY_TYPE) },
+  { "html.content", JSON_FIELD_HTML(JSON_BODY_CONTENT) },
+  { "html.preview", JSON_FIELD_HTML(JSON_BODY_PREVIEW) },
+  { "html.size",    JSON_FIELD_HTML(JSON_BODY_SIZE) },
+  { NULL, 0 }
+};
+
+
+/*
+ * Parses the comma separated list of JSON member names in the options,
+ * ignoring unknown ones. Without a list all fields are converted.
+ */
+static guint json_fields_for(const JMimeJsonOptions *options) {
+  if (!options || !options->fields)
+    return JSON_FIELDS_ALL;
+
+  guint fields = 0;
+  gchar **names = g_strsplit(options->fields, ",", -1);
+
+  guint i;
+  for (i = 0; names[i]; i++) {
+    const gchar *name = g_strstrip(names[i]);
+    if (!*name)
+      continue;
+
+    const JsonFieldName *fn;
+    for (fn = json_field_names; fn->name && strcmp(fn->name, name); fn++);
+
+    if (fn->name)
+      fields |= fn->fields;
+    else
+      g_printerr("unknown field %s\r\n", name);
+  }
+
+  g_strfreev(names);
+  return fields;
+}
+
+
+/*
+ * Converts the message within the limits, unless they are NULL.
+ */
+static MessageData *convert_message(GMimeMessage *message, ConvertMode mode, const JMimeJsonOptions *options, const JMimeLimits *limits) {
+  if (!message)
+    return NULL;
+
+  MessageData *md = new_message_data();
+  md->fields = json_fields_for(options);
+
+  if (md->fields & JSON_FIELD_MESSAGE_ID) {
+    const gchar *message_id = g_mime_message_get_message_id(message);
+    if (message_id)
+      md->message_id = g_strdup(message_id);
+  }
+
+  if (md->fields & JSON_FIELD_FROM)
+    md->from = get_from_address(message);
+  if (md->fields & JSON_FIELD_REPLY_TO)
+    md->reply_to = get_reply_to_addresses(message);
+  if (md->fields & JSON_FIELD_TO)
+    md->to = get_to_addresses(message);
+  if (md->fields & JSON_FIELD_CC)
+    md->cc = get_cc_addresses(message);
+  if (md->fields & JSON_FIELD_BCC)
+    md->bcc = get_bcc_addresses(message);
+
+  if (md->fields & JSON_FIELD_SUBJECT) {
+    const gchar *subject = g_mime_message_get_subject(message);
+    if (subject)
+      md->subject = g_strdup(subject);
+  }
+
+  if (md->fields & JSON_FIELD_DATE)
+    md->date = g_mime_message_get_date_as_string(message);
+
+  if (md->fields & JSON_FIELD_IN_REPLY_TO) {
+    const gchar *in_reply_to = g_mime_object_get_header(GMIME_OBJECT (message), "In-reply-to");
+    if (in_reply_to)
+      md->in_reply_to = g_mime_utils_header_decode_text(in_reply_to);
+  }
+
+  if (md->fields & JSON_FIELD_REFERENCES) {
+    const gchar *references = g_mime_object_get_header(GMIME_OBJECT (message), "References");
+    if (references)
+      md->references = g_mime_utils_header_decode_text(references);
+  }
+
+  guint text_fields = JSON_TEXT_BODY(md->fields);
+  guint html_fields = JSON_HTML_BODY(md->fields);
+  gboolean attachments = (md->fields & JSON_FIELD_ATTACHMENTS) != 0;
+
+  if (mode != CONVERT_HEADERS && (text_fields || html_fields || attachments)) {
+    const gchar *cid_url_template = options ? options->cid_url_template : NULL;
+
+    ConversionBudget budget;
+    conversion_budget_init(&budget, limits);
+
+    // Indexing lists attachments by name only, and references no inlines.
+    // Inlines referenced by URL are fetched separately, whatever their size.
+    // Only the sanitized html content references inlines at all.
+    gsize max_cid_size = 0;
+    if (mode == CONVERT_FULL && (html_fields & JSON_BODY_CONTENT))
+      max_cid_size = cid_url_template ? G_MAXSIZE : MAX_CID_SIZE;
+
+    gboolean measure_parts = mode != CONVERT_INDEXING && (attachments || max_cid_size);
+    PartCollectorData *pc = collect_parts(message, measure_parts, max_cid_size, &budget);
+
+    // The text body refers to no inlines
+    SanitizerContext text_ctx = { NULL, NULL, &budget };
+    SanitizerContext html_ctx = { pc->inlines_by_cid, cid_url_template, &budget };
+
+    if (pc->text_part && text_fields)
+      md->text = get_body(pc->text_part, &text_ctx, mode, text_fields);
+
+    if (pc->html_part && html_fields)
+      md->html = get_body(pc->html_part, &html_ctx, mode, html_fields);
+
+    if (attachments)
+      md->attachments = get_attachments(pc);
+
+    free_part_collector_data(pc);
+    md->truncated = budget.truncated;
+  }
+
+  return md;
+}
+
+
+
+/*
+ * JSON
+ *
+ * MessageData is written as JSON in one pass, straight into a buffer which
+ * is optionally flushed to a file descriptor as it fills up. The output is
+ * compact, with members in a fixed order. Like before, NULL values and
+ * strings which are not valid UTF-8 are left out, and strings are escaped
+ * the same way, including "/" (for embedding in HTML).
+ *
+ * The same writer produces CBOR (RFC 8949) instead: objects and arrays
+ * become indefinite length maps and arrays, so members can still be left
+ * out on the go, and strings are written as they are after their length.
+ */
+#define JSON_MAX_DEPTH  8
+#define JSON_FLUSH_SIZE 65536
+
+#define CBOR_UNSIGNED   0
+#define CBOR_TEXT       3
+#define CBOR_ARRAY      4
+#define CBOR_MAP        5
+#define CBOR_INDEFINITE 31
+#define CBOR_TRUE       0xF5
+#define CBOR_BREAK      0xFF
+
+
+typedef struct JsonWriter {
+  GString  *buffer;
+  gboolean cbor;                   // whether CBOR is written instead of JSON
+  gint     fd;                     // flushed to when the buffer fills up, or -1
+  gssize   written;                // bytes flushed to fd, -1 after a failure
+  guint    depth;
+  gboolean empty[JSON_MAX_DEPTH];  // whether the object or array has no members yet
+} JsonWriter;
+
+
+static void json_writer_init(JsonWriter *w, GString *buffer, JMimeOutputFormat format, gint fd) {
+  w->buffer  = buffer;
+  w->cbor    = format == JMIME_FORMAT_CBOR;
+  w->fd      = fd;
+  w->written = 0;
+  w->depth   = 0;
+}
+
+
+static void json_writer_flush(JsonWriter *w) {
+  if (w->fd < 0 || !w->buffer->len)
+    return;
+
+  gsize offset = 0;
+  while (w->written >= 0 && offset < w->buffer->len) {
+    gssize n = write(w->fd, w->buffer->str + offset, w->buffer->len - offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0) {
+      w->written = -1;
+    } else {
+      offset += n;
+      w->written += n;
+    }
+  }
+
+  g_string_truncate(w->buffer, 0);
+}
+
+
+static void json_writer_maybe_flush(JsonWriter *w) {
+  if (w->fd >= 0 && w->buffer->len >= JSON_FLUSH_SIZE)
+    json_writer_flush(w);
+}
+
+
+// Appends the initial bytes of a CBOR data item, in the shortest form
+static void cbor_writer_head(JsonWriter *w, guint major_type, guint64 value) {
+  guchar head[9];
+  guint n = 1;
+
+  if (value < 24) {
+    head[0] = major_type << 5 | value;
+  } else if (value <= G_MAXUINT8) {
+    head[0] = major_type << 5 | 24;
+    n += 1;
+  } else if (value <= G_MAXUINT16) {
+    head[0] = major_type << 5 | 25;
+    n += 2;
+  } else if (value <= G_MAXUINT32) {
+    head[0] = major_type << 5 | 26;
+    n += 4;
+  } else {
+    head[0] = major_type << 5 | 27;
+    n += 8;
+  }
+
+  // Followed by the value in network byte order
+  guint i;
+  for (i = 1; i < n; i++)
+    head[i] = value >> (8 * (n - 1 - i));
+
+  g_string_append_len(w->buffer, (const gchar *) head, n);
+}
+
+
+static void json_writer_begin(JsonWriter *w, gchar bracket) {
+  g_return_if_fail(w->depth < JSON_MAX_DEPTH);
+
+  if (w->cbor)
+    g_string_append_c(w->buffer, (gchar) ((bracket == '{' ? CBOR_MAP : CBOR_ARRAY) << 5 | CBOR_INDEFINITE));
+  else
+    g_string_append_c(w->buffer, bracket);
+  w->empty[w->depth++] = TRUE;
+}
+
+
+static void json_writer_end(JsonWriter *w, gchar bracket) {
+  g_return_if_fail(w->depth > 0);
+
+  if (w->cbor)
+    g_string_append_c(w->buffer, (gchar) CBOR_BREAK);
+  else
+    g_string_append_c(w->buffer, bracket);
+  w->depth--;
+  json_writer_maybe_flush(w);
+}
+
+
+// Separates the next member or element from the previous one
+static void json_writer_next(JsonWriter *w) {
+  if (!w->depth || w->cbor)
+    return;
+
+  if (!w->empty[w->depth - 1])
+    g_string_append_c(w->buffer, ',');
+  w->empty[w->depth - 1] = FALSE;
+}
+
+
+static void json_writer_escaped(JsonWriter *w, const gchar *str) {
+  if (w->cbor) {
+    gsize len = strlen(str);
+    cbor_writer_head(w, CBOR_TEXT, len);
+    g_string_append_len(w->buffer, str, len);
+    json_writer_maybe_flush(w);
+    return;
+  }
+
+  g_string_append_c(w->buffer, '"');
+
+  const gchar *p = str;
+  while (*p) {
+    const gchar *run = p;
+    while (*p && *p != '"' && *p != '\\' && *p != '/' && (guchar) *p >= 0x20)
+      p++;
+
+    g_string_append_len(w->buffer, run, p - run);
+    json_writer_maybe_flush(w);
+
+    if (!*p)
+      break;
+
+    switch (*p) {
+      case '"':  g_string_append(w->buffer, "\\\""); break;
+      case '\\': g_string_append(w->buffer, "\\\\"); break;
+      case '/':  g_string_append(w->buffer, "\\/");  break;
+      case '\b': g_string_append(w->buffer, "\\b");  break;
+      case '\f': g_string_append(w->buffer, "\\f");  break;
+      case '\n': g_string_append(w->buffer, "\\n");  break;
+      case '\r': g_string_append(w->buffer, "\\r");  break;
+      case '\t': g_string_append(w->buffer, "\\t");  break;
+      default:   g_string_append_printf(w->buffer, "\\u%04x", (guchar) *p); break;
+    }
+    p++;
+  }
+
+  g_string_append_c(w->buffer, '"');
+}
+
+
+static void json_writer_key(JsonWriter *w, const gchar *key) {
+  json_writer_next(w);
+  json_writer_escaped(w, key);
+  if (!w->cbor)
+    g_string_append_c(w->buffer, ':');
+}
+
+
+static void json_writer_string_member(JsonWriter *w, const gchar *key, const gchar *value) {
+  if (!value || !g_utf8_validate(value, -1, NULL))
+    return;
+
+  json_writer_key(w, key);
+  json_writer_escaped(w, value);
+}
+
+
+static void json_writer_true_member(JsonWriter *w, const gchar *key) {
+  json_writer_key(w, key);
+  if (w->cbor)
+    g_string_append_c(w->buffer, (gchar) CBOR_TRUE);
+  else
+    g_string_append(w->buffer, "true");
+}
+
+
+static void json_writer_uint_member(JsonWriter *w, const gchar *key, guint value) {
+  json_writer_key(w, key);
+  if (w->cbor)
+    cbor_writer_head(w, CBOR_UNSIGNED, value);
+  else
+    g_string_append_printf(w->buffer, "%u", value);
+}
+
+
+static void address_to_json(Address *addr, JsonWriter *w) {
+  json_writer_begin(w, '{');
+  json_writer_string_member(w, "name",    addr->name);
+  json_writer_string_member(w, "address", addr->address);
+  json_writer_end(w, '}');
+}
+
+
+static void addresses_list_to_json(const gchar *key, AddressesList *addr_list, JsonWriter *w) {
+  if (!addr_list)
+    return;
+
+  json_writer_key(w, key);
+  json_writer_begin(w, '[');
+
+  guint i;
+  for (i = 0; i < addr_list->len; i++) {
+    json_writer_next(w);
+    address_to_json(addresses_list_get(addr_list, i), w);
+  }
+
+  json_writer_end(w, ']');
+}
+
+
+static void message_body_to_json(const gchar *key, MessageBody *mbody, guint body_fields, JsonWriter *w) {
+  if (!mbody)
+    return;
+
+  json_writer_key(w, key);
+  json_writer_begin(w, '{');
+  if (body_fields & JSON_BODY_TYPE)
+    json_writer_string_member(w, "type", mbody->content_type);
+  json_writer_string_member(w, "content", mbody->content);
+  json_writer_string_member(w, "preview", mbody->preview);
+  if (body_fields & JSON_BODY_SIZE)
+    json_writer_uint_member(w, "size", mbody->size);
+  json_writer_end(w, '}');
+}
+
+
+static void message_attachments_list_to_json(MessageAttachmentsList *matts, JsonWriter *w) {
+  if (!matts)
+    return;
+
+  json_writer_key(w, "attachments");
+  json_writer_begin(w, '[');
+
+  guint i;
+  for (i = 0; i < matts->len; i++) {
+    MessageAttachment *att = message_attachments_list_get(matts, i);
+
+    json_writer_next(w);
+    json_writer_begin(w, '{');
+    json_writer_uint_member(w,   "partId",   att->part_id);
+    json_writer_string_member(w, "type",     att->content_type);
+    json_writer_string_member(w, "filename", att->filename);
+
+    // Attachments beyond the decoding budget have no known size
+    if (att->undecoded)
+      json_writer_true_member(w, "undecoded");
+    else
+      json_writer_uint_member(w, "size", att->size);
+    json_writer_end(w, '}');
+  }
+
+  json_writer_end(w, ']');
+}
+
+
+static void message_data_to_json(MessageData *mdata, JsonWriter *w) {
+  json_writer_begin(w, '{');
+
+  if (mdata->from) {
+    json_writer_key(w, "from");
+    address_to_json(mdata->from, w);
+  }
+
+  addresses_list_to_json("to",      mdata->to,       w);
+  addresses_list_to_json("replyTo", mdata->reply_to, w);
+  addresses_list_to_json("cc",      mdata->cc,       w);
+  addresses_list_to_json("bcc",     mdata->bcc,      w);
+
+  json_writer_string_member(w, "messageId",  mdata->message_id);
+  json_writer_string_member(w, "subject",    mdata->subject);
+  json_writer_string_member(w, "date",       mdata->date);
+  json_writer_string_member(w, "inReplyTo",  mdata->in_reply_to);
+  json_writer_string_member(w, "references", mdata->references);
+
+  // Unselected members were not converted, except for the cheap body ones
+  message_body_to_json("text", mdata->text, JSON_TEXT_BODY(mdata->fields), w);
+  message_body_to_json("html", mdata->html, JSON_HTML_BODY(mdata->fields), w);
+
+  message_attachments_list_to_json(mdata->attachments, w);
+
+  // Only present when some budget of the limits ran out
+  if (mdata->truncated)
+    json_writer_true_member(w, "truncated");
+
+  json_writer_end(w, '}');
+}
+
+
+/*
+ * Writes the message as JSON into the buffer, flushing it to fd as it fills
+ * up unless fd is -1. Returns the number of bytes flushed, or -1, and tells
+ * whether the conversion was truncated unless truncated is NULL.
+ */
+static gssize gmime_message_write_json(GMimeMessage *message, const JMimeJsonOptions *options, GString *buffer, gint fd, gboolean *truncated) {
+  ConvertMode mode = options->include_content ? CONVERT_FULL : CONVERT_HEADERS;
+  MessageData *mdata = convert_message(message, mode, options, &options->limits);
+
+  JsonWriter w;
+  json_writer_init(&w, buffer, options->format, fd);
+  message_data_to_json(mdata, &w);
+  json_writer_flush(&w);
+
+  if (truncated)
+    *truncated = mdata->truncated;
+
+  free_message_data(mdata);
+  return w.written;
+}
+
+
+static GString *gmime_message_to_json(GMimeMessage *message, const JMimeJsonOptions *options, gboolean *truncated) {
+  GString *json_string = g_string_new(NULL);
+  gmime_message_write_json(message, options, json_string, -1, truncated);
+  return json_string;
+}
+
+
+
+/*
+ * CONVERSION CACHE
+ *
+ * Messages of a mailbox with a .jmimecache directory are converted once per
+ * file state and options: the result is kept in an entry named after their
+ * SHA-256, so a hit costs a single read. Entries are replaced atomically,
+ * and their mtime tracks when they were last used, for the LRU eviction
+ * which every so often brings the directory back below CACHE_MAX_SIZE.
+ */
+typedef struct CacheEntry {
+  gchar  *path;
+  goffset size;
+  time_t last_used;
+} CacheEntry;
+
+
+static void free_cache_entry(gpointer data) {
+  CacheEntry *entry = data;
+  g_free(entry->path);
+  g_free(entry);
+}
+
+
+static gint compare_cache_entries(gconstpointer a, gconstpointer b) {
+  const CacheEntry *entry_a = *(CacheEntry * const *) a;
+  const CacheEntry *entry_b = *(CacheEntry * const *) b;
+  return (entry_a->last_used > entry_b->last_used) - (entry_a->last_used < entry_b->last_used);
+}
+
+
+static void cache_checksum_string(GChecksum *checksum, const gchar *str) {
+  // The terminating NUL keeps adjacent strings apart, NULL differs from ""
+  if (str)
+    g_checksum_update(checksum, (const guchar *) str, strlen(str) + 1);
+  g_checksum_update(checksum, (const guchar *) (str ? "s" : "n"), 1);
+}
+
+
+/*
+ * Returns the path of the cache entry for the message file as it is now
+ * converted with the options, or NULL if its mailbox has no cache.
+ */
+static gchar *cache_entry_path_for(const gchar *path, const JMimeJsonOptions *options) {
+  gchar *cache_path = mailbox_directory_for_message(path, CACHE_DIRECTORY_NAME);
+  if (!cache_path)
+    return NULL;
+
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    g_free(cache_path);
+    return NULL;
+  }
+
+  gchar *file_state = file_state_for(&st);
+  gchar *settings = g_strdup_printf("%d:%d:%d", CACHE_FORMAT_VERSION, options->include_content ? 1 : 0, options->format);
+
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  cache_checksum_string(checksum, path);
+  cache_checksum_string(checksum, file_state);
+  cache_checksum_string(checksum, settings);
+  cache_checksum_string(checksum, options->cid_url_template);
+  cache_checksum_string(checksum, options->fields);
+
+  gchar *entry_path = g_strjoin("/", cache_path, g_checksum_get_string(checksum), NULL);
+
+  g_checksum_free(checksum);
+  g_free(settings);
+  g_free(file_state);
+  g_free(cache_path);
+  return entry_path;
+}
+
+
+static GString *cache_lookup(const gchar *entry_path) {
+  gint fd = open(entry_path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  GString *data = g_string_sized_new(st.st_size);
+  gssize n = 0;
+  while (data->len < (gsize) st.st_size) {
+    n = read(fd, data->str + data->len, st.st_size - data->len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    data->len += n;
+  }
+  data->str[data->len] = '\0';
+
+  // Entries are replaced, never written in place, so a short read means trouble
+  if (data->len != (gsize) st.st_size) {
+    close(fd);
+    g_string_free(data, TRUE);
+    return NULL;
+  }
+
+  // Marks the entry as recently used, at most once per interval
+  if (time(NULL) - st.st_mtime > CACHE_TOUCH_INTERVAL)
+    futimens(fd, NULL);
+
+  close(fd);
+  return data;
+}
+
+
+/*
+ * Removes the least recently used entries until the cache takes up at most
+ * three quarters of CACHE_MAX_SIZE, if it has grown beyond that size.
+ */
+static void cache_evict(const gchar *cache_path) {
+  GDir *dir = g_dir_open(cache_path, 0, NULL);
+  if (!dir)
+    return;
+
+  GPtrArray *entries = g_ptr_array_new_with_free_func(free_cache_entry);
+  goffset total_size = 0;
+
+  const gchar *name;
+  while ((name = g_dir_read_name(dir))) {
+    gchar *entry_path = g_strjoin("/", cache_path, name, NULL);
+
+    struct stat st;
+    if (lstat(entry_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+      g_free(entry_path);
+      continue;
+    }
+
+    CacheEntry *entry = g_malloc(sizeof(CacheEntry));
+    entry->path      = entry_path;
+    entry->size      = st.st_size;
+    entry->last_used = st.st_mtime;
+    g_ptr_array_add(entries, entry);
+
+    total_size += st.st_size;
+  }
+  g_dir_close(dir);
+
+  if (total_size > CACHE_MAX_SIZE) {
+    g_ptr_array_sort(entries, compare_cache_entries);
+
+    guint i;
+    for (i = 0; i < entries->len && total_size > CACHE_MAX_SIZE / 4 * 3; i++) {
+      CacheEntry *entry = g_ptr_array_index(entries, i);
+      if (!unlink(entry->path) || errno == ENOENT)
+        total_size -= entry->size;
+    }
+  }
+
+  g_ptr_array_free(entries, TRUE);
+}
+
+
+static void cache_store(const gchar *entry_path, GString *data) {
+  GError *error = NULL;
+
+  if (!g_file_set_contents(entry_path, data->str, data->len, &error)) {
+    g_printerr("could not write cache entry: %s\r\n", error->message);
+    g_error_free(error);
+    return;
+  }
+
+  // Eviction lists the whole cache, so only some writes pay for it
+  if (!g_random_int_range(0, CACHE_EVICT_EVERY)) {
+    gchar *cache_path = g_path_get_dirname(entry_path);
+    cache_evict(cache_path);
+    g_free(cache_path);
+  }
+}
+
+
+/*
+ * Converts the message at path, going through the cache entry unless
+ * entry_path is NULL.
+ */
+static GString *cached_json_for_path(gchar *path, const JMimeJsonOptions *options, const gchar *entry_path) {
+  GString *json_message = entry_path ? cache_lookup(entry_path) : NULL;
+  if (json_message)
+    return json_message;
+
+  GMimeMessage *message = gmime_message_from_path(path);
+  if (!message)
+    return NULL;
+
+  gboolean truncated = FALSE;
+  json_message = gmime_message_to_json(message, options, &truncated);
+  g_object_unref(message);
+
+  // Entries always hold complete conversions, whatever the limits
+  if (entry_path && !truncated)
+    cache_store(entry_path, json_message);
+
+  return json_message;
+}
+
+
+/*
+ * PartBatchData
+ *
+ * Extracts many parts in a single pass over the message, writing each
+ * decoded part into its own file within the output directory. The wanted
+ * table holds the partIds still to be extracted, or is NULL for all parts.
+ */
+typedef struct PartBatchData {
+  guint       recursion_depth;
+  guint       part_id;
+  GHashTable  *wanted;
+  GHashTable  *filenames;  // used within output_dir so far
+  const gchar *output_dir;
+  gint        written;     // number of parts, -1 after a failure
+} PartBatchData;
+
+
+/*
+ * The filename as presented in the attachments list, reduced to a plain name
+ * within the output directory and made unique among the extracted parts.
+ */
+static gchar *batch_filename_for(GMimeObject *part, PartBatchData *bdata) {
+  CollectedPart *c_part = new_collected_part(bdata->part_id);
+
+  const gchar *filename = g_mime_part_get_filename(GMIME_PART(part));
+  if (filename)
+    c_part->filename = g_path_get_basename(filename);
+
+  const gchar *content_id = g_mime_part_get_content_id(GMIME_PART(part));
+  if (content_id)
+    c_part->content_id = g_strdelimit(g_strdup(content_id), G_DIR_SEPARATOR_S, '_');
+
+  gchar *content_type_str = g_mime_content_type_to_string(g_mime_object_get_content_type(part));
+  c_part->content_type = g_ascii_strdown(content_type_str, -1);
+  g_free(content_type_str);
+
+  gchar *name = filename_for(c_part);
+  free_collected_part(c_part);
+
+  if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, G_DIR_SEPARATOR_S) ||
+      g_hash_table_contains(bdata->filenames, name)) {
+    // Other parts may have been named like the prefixed name already
+    gchar *unique_name = g_strdup_printf("%u_%s", bdata->part_id, name);
+    guint n;
+    for (n = 2; g_hash_table_contains(bdata->filenames, unique_name); n++) {
+      g_free(unique_name);
+      unique_name = g_strdup_printf("%u_%u_%s", bdata->part_id, n, name);
+    }
+
+    g_free(name);
+    name = unique_name;
+  }
+
+  g_hash_table_add(bdata->filenames, g_strdup(name));
+  return name;
+}
+
+
+static void write_batch_part(GMimeObject *part, PartBatchData *bdata) {
+  GMimeDataWrapper *content = g_mime_part_get_content_object(GMIME_PART(part));
+  if (!content)
+    return;
+
+  gchar *filename = batch_filename_for(part, bdata);
+  gchar *output_path = g_build_filename(bdata->output_dir, filename, NULL);
+  g_free(filename);
+
+  int fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    g_printerr("file could not be opened for writing: %s\r\n", output_path);
+    g_free(output_path);
+    bdata->written = -1;
+    return;
+  }
+
+  // The stream owns the descriptor and closes it when released
+  GMimeStream *output = g_mime_stream_fs_new(fd);
+  gboolean failed = g_mime_data_wrapper_write_to_stream(content, output) < 0;
+  g_object_unref(output);
+
+  if (failed) {
+    g_printerr("part could not be written to file: %s\r\n", output_path);
+    unlink(output_path);
+    bdata->written = -1;
+  } else {
+    bdata->written++;
+  }
+
+  g_free(output_path);
+}
+
+
+static void part_batch_foreach_callback(GMimeObject *parent, GMimeObject *part, gpointer user_data) {
+  PartBatchData *bdata = (PartBatchData *) user_data;
+
+  if (bdata->written < 0)
+    return;
+
+  if (GMIME_IS_MESSAGE_PART(part)) {
+
+    if (bdata->recursion_depth < RECURSION_LIMIT) {
+      GMimeMessage *message = g_mime_message_part_get_message((GMimeMessagePart *) part); // transfer none
+      if (message)
+        g_mime_message_foreach(message, part_batch_foreach_callback, bdata);
+
+    } else {
+      g_printerr("endless recursion detected: %d\r\n", bdata->recursion_depth);
+      return;
+    }
+
+  } else if (GMIME_IS_MESSAGE_PARTIAL(part)) {
+    // Not extracted either
+  } else if (GMIME_IS_MULTIPART(part)) {
+    // Nothing special needed on multipart, let descend further
+  } else if (GMIME_IS_PART(part)) {
+
+    if (!bdata->wanted || g_hash_table_remove(bdata->wanted, GUINT_TO_POINTER(bdata->part_id)))
+      write_batch_part(part, bdata);
+
+    bdata->part_id++;
+
+  } else {
+    g_assert_not_reached();
+  }
+}
+
+
+static void report_missing_part(gpointer part_id, gpointer value, gpointer user_data) {
+  g_printerr("could not locate partId %u\r\n", GPOINTER_TO_UINT(part_id));
+}
+
+
+
+
+/*
+ *
+ *
+ */
+void jmime_init(void) {
+  g_mime_init(GMIME_ENABLE_RFC2047_WORKAROUNDS);
+  detect_span_kernel();
+  build_sanitizer_policy();
+  build_body_cache();
+}
+
+
+/*
+ *
+ *
+ */
+void jmime_shutdown(void) {
+  free_body_cache();
+  free_sanitizer_policy();
+  g_mime_shutdown();
+}
+
+
+/*
+ *
+ *
+ */
+GString *jmime_get_json(gchar *path, gboolean include_content) {
+  JMimeJsonOptions options;
+  jmime_json_options_init(&options);
+  options.include_content = include_content;
+
+  return jmime_get_json_with_options(path, &options);
+}
+
+
+/*
+ *
+ *
+ */
+void jmime_json_options_init(JMimeJsonOptions *options) {
+  g_return_if_fail(options != NULL);
+
+  options->include_content  = TRUE;
+  options->cid_url_template = NULL;
+  options->fields           = NULL;
+  options->format           = JMIME_FORMAT_JSON;
+  options->use_cache        = TRUE;
+  jmime_limits_init(&options->limits);
 }
 
 
-static GString *gmime_message_to_json(GMimeMessage *message, gboolean include_content) {
-  MessageData *mdata = convert_message(message, include_content);
+/*
+ *
+ *
+ */
+void jmime_limits_init(JMimeLimits *limits) {
+  g_return_if_fail(limits != NULL);
+
+  limits->max_parts         = LIMIT_PARTS;
+  limits->max_decoded_bytes = LIMIT_DECODED_BYTES;
+  limits->max_html_bytes    = LIMIT_HTML_BYTES;
+  limits->max_dom_nodes     = LIMIT_DOM_NODES;
+  limits->max_milliseconds  = LIMIT_MILLISECONDS;
+}
 
 
-  JSON_Value *root_value = json_value_init_object();
-  JSON_Object *root_object = json_value_get_object(root_value);
+/*
+ *
+ *
+ */
+GString *jmime_get_json_with_options(gchar *path, const JMimeJsonOptions *options) {
+  JMimeJsonOptions default_options;
+  if (!options) {
+    jmime_json_options_init(&default_options);
+    options = &default_options;
+  }
 
-  json_object_set_value(root_object,  "from",        address_to_json(mdata->from));
-  json_object_set_value(root_object,  "to",          addresses_list_to_json(mdata->to));
-  json_object_set_value(root_object,  "replyTo",     addresses_list_to_json(mdata->reply_to));
-  json_object_set_value(root_object,  "cc",          addresses_list_to_json(mdata->cc));
-  json_object_set_value(root_object,  "bcc",         addresses_list_to_json(mdata->bcc));
-  json_object_set_string(root_object, "messageId",   mdata->message_id);
-  json_object_set_string(root_object, "subject",     mdata->subject);
-  json_object_set_string(root_object, "date",        mdata->date);
-  json_object_set_string(root_object, "inReplyTo",   mdata->in_reply_to);
-  json_object_set_string(root_object, "references",  mdata->references);
-  json_object_set_value(root_object,  "text",        message_body_to_json(mdata->text));
-  json_object_set_value(root_object,  "html",        message_body_to_json(mdata->html));
-  json_object_set_value(root_object,  "attachments", message_attachments_list_to_json(mdata->attachments));
+  gchar *entry_path = options->use_cache ? cache_entry_path_for(path, options) : NULL;
+  GString *json_message = cached_json_for_path(path, options, entry_path);
+  g_free(entry_path);
 
-  free_message_data(mdata);
-  gchar *serialized_string = json_serialize_to_string(root_value);
-  json_value_free(root_value);
+  return json_message;
+}
 
-  GString *json_string = g_string_new(serialized_string);
-  g_free(serialized_string);
 
-  return json_string;
-}
+/*
+ * Writes the JSON straight into the file descriptor, which is left open.
+ * Returns the number of bytes written, or -1. Cached conversions are
+ * written once complete.
+ */
+gssize jmime_write_json(gchar *path, const JMimeJsonOptions *options, gint fd) {
+  JMimeJsonOptions default_options;
+  if (!options) {
+    jmime_json_options_init(&default_options);
+    options = &default_options;
+  }
 
+  gchar *entry_path = options->use_cache ? cache_entry_path_for(path, options) : NULL;
+  if (entry_path) {
+    GString *json_message = cached_json_for_path(path, options, entry_path);
+    g_free(entry_path);
+    if (!json_message)
+      return -1;
+
+    JsonWriter w;
+    json_writer_init(&w, json_message, options->format, fd);
+    json_writer_flush(&w);
+    g_string_free(json_message, TRUE);
+    return w.written;
+  }
 
+  GMimeMessage *message = gmime_message_from_path(path);
+  if (!message)
+    return -1;
 
+  GString *buffer = g_string_sized_new(JSON_FLUSH_SIZE);
+  gssize written = gmime_message_write_json(message, options, buffer, fd, NULL);
+  g_string_free(buffer, TRUE);
+  g_object_unref(message);
 
-/*
- *
- *
- */
-void jmime_init(void) {
-  g_mime_init(GMIME_ENABLE_RFC2047_WORKAROUNDS);
+  return written;
 }
 
 
@@ -1627,21 +4135,27 @@ void jmime_init(void) {
  *
  *
  */
-void jmime_shutdown(void) {
-  g_mime_shutdown();
+GString *jmime_get_envelope(gchar *path) {
+  return jmime_get_envelope_with_options(path, NULL);
 }
 
 
 /*
- *
- *
+ * Only the headers are read, whatever include_content says.
  */
-GString *jmime_get_json(gchar *path, gboolean include_content) {
-  GMimeMessage *message = gmime_message_from_path(path);
+GString *jmime_get_envelope_with_options(gchar *path, const JMimeJsonOptions *options) {
+  JMimeJsonOptions envelope_options;
+  if (options)
+    envelope_options = *options;
+  else
+    jmime_json_options_init(&envelope_options);
+  envelope_options.include_content = FALSE;
+
+  GMimeMessage *message = gmime_message_headers_from_path(path);
   if (!message)
     return NULL;
 
-  GString *json_message = gmime_message_to_json(message, include_content);
+  GString *json_message = gmime_message_to_json(message, &envelope_options, NULL);
   g_object_unref(message);
 
   return json_message;
@@ -1653,26 +4167,111 @@ GString *jmime_get_json(gchar *path, gboolean include_content) {
  *
  */
 GByteArray *jmime_get_part(gchar *path, guint part_id) {
-  GMimeMessage *message = gmime_message_from_path(path);
-  if (!message)
-    return NULL;
+  GMimeStream *mem_stream = g_mime_stream_mem_new();
+  g_mime_stream_mem_set_owner(GMIME_STREAM_MEM(mem_stream), FALSE);
 
-  GByteArray *attachment = gmime_message_get_part_data(message, part_id);
-  g_object_unref(message);
+  gssize written = write_part_from_path(path, part_id, mem_stream);
+  GByteArray *attachment = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(mem_stream));
+  g_object_unref(mem_stream);
+
+  if (written < 0) {
+    g_byte_array_free(attachment, TRUE);
+    return NULL;
+  }
 
   return attachment;
 }
 
 
+/*
+ * Returns the bytes [start, end) of the decoded part, storing its decoded
+ * length in total. The end is clamped to that length, -1 reads to the end.
+ */
+GByteArray *jmime_get_part_range(gchar *path, guint part_id, gint64 start, gint64 end, gint64 *total) {
+  g_return_val_if_fail(start >= 0, NULL);
+
+  GByteArray *range = NULL;
+  gint64 part_total = 0;
+
+  PartLocation *loc = indexed_part_location(path, part_id);
+  if (loc) {
+    GMimeStream *content_stream = located_part_stream(path, loc);
+    if (content_stream) {
+      range = read_part_range(content_stream, loc->encoding, start, end, &part_total);
+      g_object_unref(content_stream);
+    }
+    free_part_location(loc);
+
+  } else {
+    GMimeMessage *message = gmime_message_from_path(path);
+    if (!message)
+      return NULL;
+
+    GMimeDataWrapper *content = gmime_message_get_part_content(message, part_id);
+    if (content) {
+      range = read_part_range(g_mime_data_wrapper_get_stream(content), g_mime_data_wrapper_get_encoding(content), start, end, &part_total);
+      g_object_unref(content);
+    }
+    g_object_unref(message);
+  }
+
+  if (range && total)
+    *total = part_total;
+
+  return range;
+}
+
+
+/*
+ * Writes the decoded parts with the given partIds, or all parts when part_ids
+ * is NULL, into files within output_dir named like the attachments, parsing
+ * the message once. Returns the number of parts written, or -1.
+ */
+gint jmime_write_parts(gchar *path, const guint *part_ids, guint n_part_ids, const gchar *output_dir) {
+  g_return_val_if_fail(output_dir != NULL, -1);
 
-static MessageData *jmime_message_from_path(const gchar *path, gboolean include_content) {
   GMimeMessage *message = gmime_message_from_path(path);
   if (!message)
-    return NULL;
+    return -1;
+
+  PartBatchData bdata = { 0, 0, NULL, NULL, output_dir, 0 };
+  bdata.filenames = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  if (part_ids) {
+    bdata.wanted = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    guint i;
+    for (i = 0; i < n_part_ids; i++)
+      g_hash_table_add(bdata.wanted, GUINT_TO_POINTER(part_ids[i]));
+  }
 
-  MessageData *mdata = convert_message(message, include_content);
+  g_mime_message_foreach(message, part_batch_foreach_callback, &bdata);
   g_object_unref(message);
-  return mdata;
+
+  if (bdata.wanted) {
+    if (bdata.written >= 0)
+      g_hash_table_foreach(bdata.wanted, report_missing_part, NULL);
+    g_hash_table_destroy(bdata.wanted);
+  }
+
+  g_hash_table_destroy(bdata.filenames);
+  return bdata.written;
+}
+
+
+/*
+ * Decodes the part straight into the file descriptor, which is left open.
+ * Returns the number of bytes written, -1 if the part could not be found or
+ * read, or -2 if writing to the file descriptor failed.
+ */
+gssize jmime_write_part(gchar *path, guint part_id, gint fd) {
+  GMimeStream *fd_stream = g_mime_stream_fs_new(fd);
+  g_mime_stream_fs_set_owner(GMIME_STREAM_FS(fd_stream), FALSE);
+
+  gssize written = write_part_from_path(path, part_id, fd_stream);
+  g_object_unref(fd_stream);
+
+  return written;
 }
 
 
@@ -1684,8 +4283,12 @@ static void free_indexing_message(IndexingMessage *im) {
   g_return_if_fail(im != NULL);
 
   g_free(im->path);
+  g_free(im->unique_name);
   g_free(im->i_from);
 
+  if (im->flags)
+    g_free(im->flags);
+
   if (im->i_to)
     g_free(im->i_to);
 
@@ -1701,6 +4304,12 @@ static void free_indexing_message(IndexingMessage *im) {
   if (im->i_attachments)
     g_free(im->i_attachments);
 
+  if (im->file_state)
+    g_free(im->file_state);
+
+  if (im->structure)
+    g_free(im->structure);
+
   g_free(im);
 }
 
@@ -1763,23 +4372,34 @@ static gchar *message_attachments_list_to_indexing_string(MessageAttachmentsList
  *
  *
  */
-static IndexingMessage *indexing_message_from_path(const gchar *path) {
-  MessageData *mdata = jmime_message_from_path(path, TRUE);
+static IndexingMessage *indexing_message_from_path(const gchar *path, const JMimeLimits *limits) {
+  // Taken before parsing, so a change while parsing is picked up next time
+  struct stat st;
+  if (stat(path, &st)) {
+    g_printerr("cannot stat file '%s': %s\r\n", path, g_strerror(errno));
+    return NULL;
+  }
+
+  GMimeMessage *message = gmime_message_from_path(path);
+  if (!message)
+    return NULL;
+
+  MessageData *mdata = convert_message(message, CONVERT_INDEXING, NULL, limits);
+  if (mdata->truncated)
+    g_printerr("message '%s' exceeds its limits and is indexed partially\r\n", path);
+
   IndexingMessage *im = g_malloc(sizeof(IndexingMessage));
-  im->path = g_strdup(path);
+  im->path        = g_strdup(path);
+  im->unique_name = maildir_unique_name(path);
+  im->flags       = maildir_flags(path);
+  im->file_state  = file_state_for(&st);
+  im->structure   = gmime_message_structure(message);
+
+  g_object_unref(message);
 
   im->i_message_id = NULL;
   if (mdata->message_id)
     im->i_message_id = g_strdup(mdata->message_id);
-  else {
-    gchar *filename = basename(im->path);
-    gchar **fparts = g_strsplit(filename, ":", -1);
-    if (fparts[0])
-      im->i_message_id = g_strdup(fparts[0]);
-    else
-      im->i_message_id = g_strdup(filename);
-    g_strfreev(fparts);
-  }
 
   im->i_subject = NULL;
   if (mdata->subject)
@@ -1787,15 +4407,17 @@ static IndexingMessage *indexing_message_from_path(const gchar *path) {
 
   im->i_content = NULL;
   if (mdata->html)
-    im->i_content = g_strdup(mdata->html->content); // TODO this should be full text content, not shorthened. let JSONifier shorten or own needds
+    im->i_content = g_strdup(mdata->html->content);
   else if (mdata->text)
     im->i_content = g_strdup(mdata->text->content);
 
   GString *i_from_str = g_string_new(NULL);
-  g_string_append(i_from_str, mdata->from->address);
-  if (mdata->from->name) {
-    g_string_append_c(i_from_str, ' ');
-    g_string_append(i_from_str, mdata->from->name);
+  if (mdata->from) {
+    g_string_append(i_from_str, mdata->from->address);
+    if (mdata->from->name) {
+      g_string_append_c(i_from_str, ' ');
+      g_string_append(i_from_str, mdata->from->name);
+    }
   }
   if (mdata->reply_to) {
     gchar *reply_to_str = addresses_list_to_indexing_string(mdata->reply_to);
@@ -1839,6 +4461,233 @@ static IndexingMessage *indexing_message_from_path(const gchar *path) {
 }
 
 
+/*
+ * JMimeIndexer
+ *
+ * An indexing session on the index of one mailbox, keeping the index
+ * database open across messages and committing in batches.
+ */
+struct JMimeIndexer {
+  XapianIndexer *xapian;
+  JMimeLimits   limits;
+  GHashTable    *indexed_files;  // unique name => IndexedFile, while indexing a mailbox
+  gboolean      migrating;       // reindexing an index of an older layout
+};
+
+
+/*
+ * IndexedFile
+ *
+ * A message file known to the index. Files not seen while walking the
+ * mailbox have been removed, and so are their documents. Files seen under
+ * another name have been renamed by the client (moved or flagged), and only
+ * their location is updated.
+ */
+typedef struct IndexedFile {
+  guint    docid;
+  gchar    *path;
+  gchar    *file_state;
+  gboolean seen;
+  gchar    *renamed_path;
+} IndexedFile;
+
+
+static void free_indexed_file(gpointer ifile_ptr) {
+  g_return_if_fail(ifile_ptr != NULL);
+
+  IndexedFile *ifile = (IndexedFile *) ifile_ptr;
+  g_free(ifile->path);
+  g_free(ifile->file_state);
+  g_free(ifile->renamed_path);
+  g_free(ifile);
+}
+
+
+static void collect_indexed_file(unsigned int docid, const char *path, const char *file_state, void *user_data) {
+  IndexedFile *ifile = g_malloc(sizeof(IndexedFile));
+  ifile->docid        = docid;
+  ifile->path         = g_strdup(path);
+  ifile->file_state   = g_strdup(file_state);
+  ifile->seen         = FALSE;
+  ifile->renamed_path = NULL;
+  g_hash_table_replace((GHashTable *) user_data, maildir_unique_name(path), ifile);
+}
+
+
+static gboolean indexer_load_indexed_files(JMimeIndexer *indexer) {
+  indexer->indexed_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_indexed_file);
+  return xapian_indexer_foreach_document(indexer->xapian, collect_indexed_file, indexer->indexed_files) == 0;
+}
+
+
+/*
+ * Marks the message file as seen and tells whether it needs to be (re)indexed.
+ */
+static gboolean indexer_file_changed(JMimeIndexer *indexer, const gchar *message_path, gboolean full) {
+  if (!indexer->indexed_files)
+    return TRUE;
+
+  gchar *unique_name = maildir_unique_name(message_path);
+  IndexedFile *ifile = g_hash_table_lookup(indexer->indexed_files, unique_name);
+  g_free(unique_name);
+
+  if (!ifile)
+    return TRUE;
+
+  // A second file with the same unique name takes over the document, which
+  // is then reindexed rather than relocated to the first file
+  if (ifile->seen) {
+    g_free(ifile->renamed_path);
+    ifile->renamed_path = NULL;
+    return TRUE;
+  }
+
+  ifile->seen = TRUE;
+  if (full || !ifile->file_state)
+    return TRUE;
+
+  struct stat st;
+  if (stat(message_path, &st))
+    return TRUE;
+
+  // Renaming keeps inode, size and mtime, so the state tells content changes apart
+  gchar *file_state = file_state_for(&st);
+  gboolean changed = g_strcmp0(file_state, ifile->file_state) != 0;
+  g_free(file_state);
+
+  if (!changed && strcmp(message_path, ifile->path))
+    ifile->renamed_path = g_strdup(message_path);
+
+  return changed;
+}
+
+
+/*
+ * Removes documents of removed files, and relocates those of renamed ones.
+ * After an incomplete walk of the mailbox, unseen files may still exist, so
+ * their documents are kept unless remove_unseen is set.
+ */
+static void indexer_update_files(JMimeIndexer *indexer, gboolean remove_unseen) {
+  GHashTableIter iter;
+  gpointer unique_name, value;
+
+  g_hash_table_iter_init(&iter, indexer->indexed_files);
+  while (g_hash_table_iter_next(&iter, &unique_name, &value)) {
+    IndexedFile *ifile = (IndexedFile *) value;
+
+    if (!ifile->seen) {
+      if (remove_unseen) {
+        g_printf("Removing: %s\n", ifile->path);
+        xapian_indexer_delete_document(indexer->xapian, ifile->docid, ifile->path);
+      }
+
+    } else if (ifile->renamed_path) {
+      g_printf("Renaming: %s\n", ifile->renamed_path);
+      gchar *flags = maildir_flags(ifile->renamed_path);
+      xapian_indexer_relocate_document(indexer->xapian, ifile->docid, ifile->renamed_path, ifile->file_state, flags);
+      g_free(flags);
+    }
+  }
+}
+
+
+void jmime_index_options_init(JMimeIndexOptions *options) {
+  g_return_if_fail(options != NULL);
+
+  options->commit_documents = INDEX_COMMIT_DOCUMENTS;
+  options->commit_bytes     = INDEX_COMMIT_BYTES;
+  options->jobs             = INDEX_JOBS;
+  options->full             = FALSE;
+  jmime_limits_init(&options->limits);
+}
+
+
+/*
+ *
+ *
+ */
+JMimeIndexer *jmime_indexer_open(const gchar *mailbox_path, const JMimeIndexOptions *options) {
+  g_return_val_if_fail(mailbox_path != NULL, NULL);
+
+  JMimeIndexOptions default_options;
+  if (!options) {
+    jmime_index_options_init(&default_options);
+    options = &default_options;
+  }
+
+  gchar *index_path = g_strjoin("/", mailbox_path, INDEX_DIRECTORY_NAME, NULL);
+  XapianIndexer *xapian = xapian_indexer_open(index_path, options->commit_documents, options->commit_bytes);
+  g_free(index_path);
+
+  if (!xapian)
+    return NULL;
+
+  JMimeIndexer *indexer = g_malloc(sizeof(JMimeIndexer));
+  indexer->xapian        = xapian;
+  indexer->limits        = options->limits;
+  indexer->indexed_files = NULL;
+  indexer->migrating     = FALSE;
+  return indexer;
+}
+
+
+/*
+ * Adds an already parsed message to the index, releasing it.
+ */
+static gboolean indexer_write_message(JMimeIndexer *indexer, IndexingMessage *im) {
+  g_printf("Indexing: %s\n", im->path);
+  gboolean indexed = xapian_indexer_add(indexer->xapian, im) == 0;
+  free_indexing_message(im);
+  return indexed;
+}
+
+
+/*
+ *
+ *
+ */
+gboolean jmime_indexer_add(JMimeIndexer *indexer, const gchar *message_path) {
+  g_return_val_if_fail(indexer != NULL, FALSE);
+  g_return_val_if_fail(message_path != NULL, FALSE);
+
+  // Single messages would mix both layouts, only a mailbox walk migrates the index
+  if (!indexer->migrating && !xapian_indexer_layout_current(indexer->xapian)) {
+    g_printerr("not indexing '%s': the index has an older layout, index the whole mailbox first\r\n", message_path);
+    return FALSE;
+  }
+
+  IndexingMessage *im = indexing_message_from_path(message_path, &indexer->limits);
+  if (!im)
+    return FALSE;
+
+  return indexer_write_message(indexer, im);
+}
+
+
+/*
+ * Commits pending documents, telling whether that succeeded.
+ */
+gboolean jmime_indexer_flush(JMimeIndexer *indexer) {
+  g_return_val_if_fail(indexer != NULL, FALSE);
+  return xapian_indexer_flush(indexer->xapian) == 0;
+}
+
+
+/*
+ *
+ *
+ */
+void jmime_indexer_close(JMimeIndexer *indexer) {
+  g_return_if_fail(indexer != NULL);
+  xapian_indexer_close(indexer->xapian);
+
+  if (indexer->indexed_files)
+    g_hash_table_destroy(indexer->indexed_files);
+
+  g_free(indexer);
+}
+
+
 /*
  *
  *
@@ -1847,50 +4696,174 @@ void jmime_index_message(const gchar *mailbox_path, const gchar *message_path) {
   g_return_if_fail(mailbox_path != NULL);
   g_return_if_fail(message_path != NULL);
 
-  IndexingMessage *im = indexing_message_from_path(message_path);
+  JMimeIndexer *indexer = jmime_indexer_open(mailbox_path, NULL);
+  if (!indexer)
+    return;
 
-  if (im) {
-    g_printf("Indexing: %s\n", message_path);
-    gchar *index_path = g_strjoin("/", mailbox_path, INDEX_DIRECTORY_NAME, NULL);
-    xapian_index_message(index_path, im);
-    g_free(index_path);
-    free_indexing_message(im);
-  }
+  jmime_indexer_add(indexer, message_path);
+  jmime_indexer_close(indexer);
 }
 
 
 
 /*
+ * IndexingPipeline
  *
+ * Parallel indexing of many messages: worker threads parse messages into
+ * IndexingMessages and queue them for a single writer thread, which owns
+ * the index. At most `capacity` messages are in flight (waiting to be parsed,
+ * parsed or waiting to be written); submitting blocks beyond that, which keeps
+ * memory bounded when parsing outruns the writer.
  *
+ * Without workers (1 job), messages are parsed and written on submission.
  */
-static void index_directory_messages(const gchar *mailbox_path, const gchar *dir_path) {
-  g_return_if_fail(mailbox_path != NULL);
-  g_return_if_fail(dir_path != NULL);
+typedef struct IndexingPipeline {
+  JMimeIndexer *indexer;
+  gboolean     full;        // reindex unchanged messages too
+  GThreadPool  *workers;
+  GThread      *writer;
+  GAsyncQueue  *parsed;     // of IndexingMessages, terminated with the pipeline itself
+  GMutex       lock;
+  GCond        released;
+  guint        in_flight;
+  guint        capacity;
+} IndexingPipeline;
+
+
+static void indexing_pipeline_release(IndexingPipeline *pipeline) {
+  g_mutex_lock(&pipeline->lock);
+  pipeline->in_flight--;
+  g_cond_signal(&pipeline->released);
+  g_mutex_unlock(&pipeline->lock);
+}
+
+
+static void indexing_pipeline_parse(gpointer data, gpointer user_data) {
+  IndexingPipeline *pipeline = (IndexingPipeline *) user_data;
+  gchar *message_path = (gchar *) data;
+
+  IndexingMessage *im = indexing_message_from_path(message_path, &pipeline->indexer->limits);
+  g_free(message_path);
+
+  if (im)
+    g_async_queue_push(pipeline->parsed, im);
+  else
+    indexing_pipeline_release(pipeline);
+}
+
+
+static gpointer indexing_pipeline_write(gpointer user_data) {
+  IndexingPipeline *pipeline = (IndexingPipeline *) user_data;
+
+  gpointer item;
+  while ((item = g_async_queue_pop(pipeline->parsed)) != pipeline) {
+    indexer_write_message(pipeline->indexer, (IndexingMessage *) item);
+    indexing_pipeline_release(pipeline);
+  }
+  return NULL;
+}
+
+
+static IndexingPipeline *new_indexing_pipeline(JMimeIndexer *indexer, guint jobs, gboolean full) {
+  IndexingPipeline *pipeline = g_malloc(sizeof(IndexingPipeline));
+  pipeline->indexer   = indexer;
+  pipeline->full      = full;
+  pipeline->workers   = NULL;
+  pipeline->writer    = NULL;
+  pipeline->parsed    = NULL;
+  pipeline->in_flight = 0;
+  pipeline->capacity  = jobs * INDEX_QUEUED_PER_JOB;
+  g_mutex_init(&pipeline->lock);
+  g_cond_init(&pipeline->released);
+
+  if (jobs > 1) {
+    GError *error = NULL;
+    pipeline->workers = g_thread_pool_new(indexing_pipeline_parse, pipeline, jobs, TRUE, &error);
+
+    if (!pipeline->workers) {
+      g_printerr("indexing workers could not be started: %s\r\n", error->message);
+      g_error_free(error);
+      return pipeline;
+    }
+
+    pipeline->parsed = g_async_queue_new();
+    pipeline->writer = g_thread_new("jmime-index-writer", indexing_pipeline_write, pipeline);
+  }
+
+  return pipeline;
+}
+
+
+static void indexing_pipeline_submit(IndexingPipeline *pipeline, const gchar *message_path) {
+  if (!pipeline->workers) {
+    jmime_indexer_add(pipeline->indexer, message_path);
+    return;
+  }
+
+  g_mutex_lock(&pipeline->lock);
+  while (pipeline->in_flight >= pipeline->capacity)
+    g_cond_wait(&pipeline->released, &pipeline->lock);
+  pipeline->in_flight++;
+  g_mutex_unlock(&pipeline->lock);
+
+  g_thread_pool_push(pipeline->workers, g_strdup(message_path), NULL);
+}
+
+
+/*
+ * Waits until all submitted messages are written, and releases the pipeline.
+ */
+static void free_indexing_pipeline(IndexingPipeline *pipeline) {
+  g_return_if_fail(pipeline != NULL);
+
+  if (pipeline->workers) {
+    g_thread_pool_free(pipeline->workers, FALSE, TRUE);
+    g_async_queue_push(pipeline->parsed, pipeline);
+    g_thread_join(pipeline->writer);
+    g_async_queue_unref(pipeline->parsed);
+  }
+
+  g_mutex_clear(&pipeline->lock);
+  g_cond_clear(&pipeline->released);
+  g_free(pipeline);
+}
+
+
+
+/*
+ * Returns FALSE when the directory could not be listed.
+ */
+static gboolean index_directory_messages(IndexingPipeline *pipeline, const gchar *dir_path) {
+  g_return_val_if_fail(pipeline != NULL, FALSE);
+  g_return_val_if_fail(dir_path != NULL, FALSE);
 
   struct dirent **namelist;
   int fl = scandir(dir_path, &namelist, NULL, NULL);
 
-  if (fl < 0)
+  if (fl < 0) {
     perror("scandir");
-  else
-    while (fl--)
-      if (namelist[fl]->d_name[0] != '.') {
-        gchar *message_path = g_strjoin("/", dir_path, namelist[fl]->d_name, NULL);
-        g_free(namelist[fl]);
-        jmime_index_message(mailbox_path, message_path);
-        g_free(message_path);
-      }
+    return FALSE;
+  }
+
+  while (fl--) {
+    if (namelist[fl]->d_name[0] != '.') {
+      gchar *message_path = g_strjoin("/", dir_path, namelist[fl]->d_name, NULL);
+      if (indexer_file_changed(pipeline->indexer, message_path, pipeline->full))
+        indexing_pipeline_submit(pipeline, message_path);
+      g_free(message_path);
+    }
+    g_free(namelist[fl]);
+  }
   g_free(namelist);
+  return TRUE;
 }
 
 
 
 /*
- *
- *
+ * Sets failed when the directory could not be listed.
  */
-static gboolean is_maildir(const gchar *path) {
+static gboolean is_maildir(const gchar *path, gboolean *failed) {
     g_return_val_if_fail(path != NULL, FALSE);
 
     struct dirent **namelist;
@@ -1918,6 +4891,7 @@ static gboolean is_maildir(const gchar *path) {
     }
 
     perror("scandir");
+    *failed = TRUE;
     return FALSE;
 }
 
@@ -1927,7 +4901,7 @@ static gboolean is_maildir(const gchar *path) {
  *
  *
  */
-void jmime_index_mailbox(const gchar *mailbox_path) {
+void jmime_index_mailbox_with_options(const gchar *mailbox_path, const JMimeIndexOptions *options) {
   g_return_if_fail(mailbox_path != NULL);
   g_return_if_fail(access(mailbox_path, F_OK) != -1);
 
@@ -1941,40 +4915,97 @@ void jmime_index_mailbox(const gchar *mailbox_path) {
     return;
   }
 
+  JMimeIndexOptions default_options;
+  if (!options) {
+    jmime_index_options_init(&default_options);
+    options = &default_options;
+  }
+
+  JMimeIndexer *indexer = jmime_indexer_open(mailbox_path, options);
+  if (!indexer) {
+    fts_close(tree);
+    return;
+  }
+
+  if (!indexer_load_indexed_files(indexer)) {
+    jmime_indexer_close(indexer);
+    fts_close(tree);
+    return;
+  }
+
+  if (!xapian_indexer_layout_current(indexer->xapian)) {
+    g_printf("Index has an older layout, reindexing all messages\n");
+    indexer->migrating = TRUE;
+  }
+
+  IndexingPipeline *pipeline = new_indexing_pipeline(indexer, options->jobs, options->full || indexer->migrating);
+
   FTSENT *node;
   FTSENT *child;
 
+  // Documents are only removed for files missing from a complete walk
+  gboolean walk_failed = FALSE;
+
+  errno = 0;
   while((node = fts_read(tree)) != NULL) {
-    if (node->fts_level > 0 && node->fts_name[0] == '.')
+    if (node->fts_info == FTS_DNR || node->fts_info == FTS_ERR || node->fts_info == FTS_NS) {
+      g_printerr("cannot read '%s': %s\r\n", node->fts_path, g_strerror(node->fts_errno));
+      walk_failed = TRUE;
+    } else if (node->fts_level > 0 && node->fts_name[0] == '.') {
       fts_set(tree, node, FTS_SKIP);
-    else if ((node->fts_info & FTS_D) && is_maildir(node->fts_path)) {
+    } else if ((node->fts_info & FTS_D) && is_maildir(node->fts_path, &walk_failed)) {
+      errno = 0;
       child = fts_children(tree, 0);
 
       if (errno) {
         perror("fts_children");
+        walk_failed = TRUE;
+        errno = 0;
         continue;
       }
 
-      while (child && child->fts_link) {
-        if ((child->fts_info & FTS_D) && (!g_ascii_strcasecmp(child->fts_name, "cur"))) {
+      while (child) {
+        if ((child->fts_info & FTS_D) &&
+            (!g_ascii_strcasecmp(child->fts_name, "cur") || !g_ascii_strcasecmp(child->fts_name, "new"))) {
           gchar *dir_path = g_strjoin("/", child->fts_path, child->fts_name, NULL);
-          index_directory_messages(mailbox_path, dir_path);
+          if (!index_directory_messages(pipeline, dir_path))
+            walk_failed = TRUE;
           g_free(dir_path);
           fts_set(tree, child, FTS_SKIP);
         }
         child = child->fts_link;
       }
     }
+    errno = 0;
   }
 
-  if (errno)
+  if (errno) {
     perror("fts_read");
+    walk_failed = TRUE;
+  }
+
+  if (walk_failed)
+    g_printerr("mailbox '%s' was not read completely, keeping documents of unseen files\r\n", mailbox_path);
+
+  free_indexing_pipeline(pipeline);
+  indexer_update_files(indexer, !walk_failed);
+
+  // Old documents go only once every message has been indexed again
+  if (indexer->migrating && !walk_failed)
+    xapian_indexer_migrate_layout(indexer->xapian);
+
+  jmime_indexer_close(indexer);
 
   if (fts_close(tree))
     perror("fts_close");
 }
 
 
+void jmime_index_mailbox(const gchar *mailbox_path) {
+  jmime_index_mailbox_with_options(mailbox_path, NULL);
+}
+
+
 gchar **jmime_search_mailbox(const gchar *mailbox_path, const gchar *query, const guint max_results) {
   g_return_val_if_fail(mailbox_path != NULL, NULL);
   g_return_val_if_fail(query != NULL, NULL);
@@ -1,9 +1,112 @@
 void jmime_init(void);
 void jmime_shutdown(void);
 
+/*
+ * JMimeLimits
+ *
+ * Budgets for converting a single message, against pathological ones (0
+ * disables a limit): the parts collected, the bytes decoded from them, the
+ * bytes of an HTML body handed to the parser, the DOM nodes walked and the
+ * wall-clock time. Running out of a budget degrades the conversion rather
+ * than failing it: bodies are cut short, attachments beyond the decoding
+ * budget are listed with "undecoded": true instead of a size, parts beyond
+ * max_parts are left out, and the result is flagged as "truncated".
+ */
+typedef struct JMimeLimits {
+  guint max_parts;
+  gsize max_decoded_bytes;
+  gsize max_html_bytes;
+  guint max_dom_nodes;
+  guint max_milliseconds;
+} JMimeLimits;
+
+void jmime_limits_init(JMimeLimits *limits);
+
+/*
+ * JMimeJsonOptions
+ *
+ * Controls the conversion of a message to JSON. Without include_content only
+ * the headers are converted.
+ *
+ * Inline images referenced by cid: URLs are embedded as data URIs, unless a
+ * cid_url_template like "/parts/{partId}" is given: they are then referenced
+ * by that URL, with {partId} replaced by their partId for jmime_get_part.
+ *
+ * fields is a comma separated list of the members to convert, like
+ * "from,subject,text.preview,attachments", or NULL for all of them. Bodies
+ * are selected as a whole ("html") or by member ("html.content"); work for
+ * members which are not selected, like sanitizing, is skipped.
+ *
+ * With JMIME_FORMAT_CBOR the same document is encoded as CBOR, with
+ * length-prefixed strings which need no escaping. The returned GString then
+ * holds binary data of its len.
+ *
+ * Messages of a mailbox with a .jmimecache directory are converted once per
+ * file state and options, and read from there later on, unless use_cache
+ * is FALSE.
+ */
+typedef enum JMimeOutputFormat {
+  JMIME_FORMAT_JSON,
+  JMIME_FORMAT_CBOR
+} JMimeOutputFormat;
+
+typedef struct JMimeJsonOptions {
+  gboolean          include_content;
+  const gchar       *cid_url_template;
+  const gchar       *fields;
+  JMimeOutputFormat format;
+  gboolean          use_cache;
+  JMimeLimits       limits;
+} JMimeJsonOptions;
+
+void jmime_json_options_init(JMimeJsonOptions *options);
+
 GString*    jmime_get_json(gchar *path, gboolean include_content);
+GString*    jmime_get_json_with_options(gchar *path, const JMimeJsonOptions *options);
+gssize      jmime_write_json(gchar *path, const JMimeJsonOptions *options, gint fd);
+GString*    jmime_get_envelope(gchar *path);
+GString*    jmime_get_envelope_with_options(gchar *path, const JMimeJsonOptions *options);
 GByteArray* jmime_get_part(gchar *path, guint part_id);
+gssize      jmime_write_part(gchar *path, guint part_id, gint fd);
+gint        jmime_write_parts(gchar *path, const guint *part_ids, guint n_part_ids, const gchar *output_dir);
+GByteArray* jmime_get_part_range(gchar *path, guint part_id, gint64 start, gint64 end, gint64 *total);
+
+/*
+ * JMimeIndexOptions
+ *
+ * Controls how often an indexing session commits to the index: after
+ * commit_documents documents or commit_bytes bytes of indexed text,
+ * whichever comes first (0 disables the respective limit).
+ *
+ * Mailbox indexing parses messages on `jobs` worker threads while a single
+ * writer adds them to the index; with 1 job everything runs serially.
+ *
+ * Messages whose file (inode, size and mtime) did not change since they were
+ * indexed are skipped, unless `full` is set. Documents of removed files are
+ * always deleted from the index. Messages in new/ and cur/ are identified by
+ * their maildir unique name, so renamed files (moved or flagged by a client)
+ * only get their path and flags updated.
+ *
+ * Every message is converted within the limits.
+ */
+typedef struct JMimeIndexOptions {
+  guint       commit_documents;
+  gsize       commit_bytes;
+  guint       jobs;
+  gboolean    full;
+  JMimeLimits limits;
+} JMimeIndexOptions;
+
+void jmime_index_options_init(JMimeIndexOptions *options);
+
+typedef struct JMimeIndexer JMimeIndexer;
+
+JMimeIndexer *jmime_indexer_open(const gchar *mailbox_path, const JMimeIndexOptions *options);
+gboolean jmime_indexer_add(JMimeIndexer *indexer, const gchar *message_path);
+gboolean jmime_indexer_flush(JMimeIndexer *indexer);
+void jmime_indexer_close(JMimeIndexer *indexer);
 
 void jmime_index_message(const gchar *mailbox_path, const gchar *message_path);
 void jmime_index_mailbox(const gchar *mailbox_path);
+void jmime_index_mailbox_with_options(const gchar *mailbox_path, const JMimeIndexOptions *options);
 gchar **jmime_search_mailbox(const gchar *mailbox_path, const gchar *query, const guint max_results);
\ No newline at end of file
@@ -2,45 +2,373 @@
 #include <iostream>
 #include "jxapian.h"
 #include <cstring>
+#include <vector>
+#include <pthread.h>
+
+#define VALUE_PATH       0
+#define VALUE_FILE_STATE 1
+#define VALUE_STRUCTURE  2
+
+// Documents are identified by the maildir unique name of their message file.
+// Indexes written with another layout keep their documents until a complete
+// walk of the mailbox has indexed every message again.
+#define INDEX_LAYOUT_KEY "jmime:layout"
+#define INDEX_LAYOUT     "maildir-unique-name"
+
+#define FLAG_PREFIX       "XF"
+#define MESSAGE_ID_PREFIX "M"
+#define MAX_TERM_LENGTH   240
 
 extern "C" {
 
-  void xapian_index_message(const char *index_path, IndexingMessage *pm) {
+  struct XapianIndexer {
+    Xapian::WritableDatabase *database;
+    Xapian::TermGenerator    indexer;
+    unsigned int             flush_documents;
+    size_t                   flush_bytes;
+    unsigned int             pending_documents;
+    size_t                   pending_bytes;
+    Xapian::docid            old_layout_lastdocid;  // last document of another layout, 0 if none
+  };
+
+
+  static size_t indexing_message_size(IndexingMessage *pm) {
+    size_t size = 0;
+    const char *fields[] = { pm->i_from, pm->i_to, pm->i_attachments, pm->i_subject, pm->i_content };
+    for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+      if (fields[i])
+        size += std::strlen(fields[i]);
+    return size;
+  }
+
+
+  static void add_flag_terms(Xapian::Document &doc, const char *flags) {
+    if (!flags)
+      return;
+
+    for (const char *flag = flags; *flag; flag++) {
+      std::string flag_term = FLAG_PREFIX;
+      flag_term += *flag;
+      doc.add_term(flag_term);
+    }
+  }
+
+
+  static void remove_flag_terms(Xapian::Document &doc) {
+    std::vector<std::string> flag_terms;
+
+    Xapian::TermIterator term = doc.termlist_begin();
+    for (term.skip_to(FLAG_PREFIX); term != doc.termlist_end(); ++term) {
+      if ((*term).compare(0, std::strlen(FLAG_PREFIX), FLAG_PREFIX))
+        break;
+      flag_terms.push_back(*term);
+    }
+
+    for (std::vector<std::string>::iterator it = flag_terms.begin(); it != flag_terms.end(); ++it)
+      doc.remove_term(*it);
+  }
+
+
+  static Xapian::docid check_layout(Xapian::WritableDatabase *database) {
+    if (database->get_metadata(INDEX_LAYOUT_KEY) == INDEX_LAYOUT)
+      return 0;
+
+    if (database->get_doccount())
+      return database->get_lastdocid();
+
+    database->set_metadata(INDEX_LAYOUT_KEY, INDEX_LAYOUT);
+    database->commit();
+    return 0;
+  }
+
+
+  XapianIndexer *xapian_indexer_open(const char *index_path, unsigned int flush_documents, size_t flush_bytes) {
     try {
-      Xapian::WritableDatabase database(index_path, Xapian::DB_CREATE_OR_OPEN);
+      XapianIndexer *xi = new XapianIndexer();
+      xi->database = new Xapian::WritableDatabase(index_path, Xapian::DB_CREATE_OR_OPEN);
+      xi->old_layout_lastdocid = check_layout(xi->database);
+      xi->indexer.set_stemmer(Xapian::Stem("english"));
+      xi->flush_documents   = flush_documents;
+      xi->flush_bytes       = flush_bytes;
+      xi->pending_documents = 0;
+      xi->pending_bytes     = 0;
+      return xi;
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      return NULL;
+    }
+  }
+
 
+  int xapian_indexer_flush(XapianIndexer *xi) {
+    if (!xi->pending_documents)
+      return 0;
+
+    try {
+      xi->database->commit();
+      xi->pending_documents = 0;
+      xi->pending_bytes     = 0;
+      return 0;
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      return -1;
+    }
+  }
+
+
+  int xapian_indexer_add(XapianIndexer *xi, IndexingMessage *pm) {
+    try {
       Xapian::Document doc;
-      Xapian::TermGenerator indexer;
-      Xapian::Stem stemmer("english");
-      indexer.set_stemmer(stemmer);
-      indexer.set_document(doc);
+      xi->indexer.set_document(doc);
 
       // Unique ids: http://trac.xapian.org/wiki/FAQ/UniqueIds
       doc.set_data(pm->path);
+      doc.add_value(VALUE_PATH, pm->path);
+
+      if (pm->file_state)
+        doc.add_value(VALUE_FILE_STATE, pm->file_state);
+
+      if (pm->structure)
+        doc.add_value(VALUE_STRUCTURE, pm->structure);
 
       std::string id_term = "Q";
-      id_term += pm->i_message_id;
+      id_term += pm->unique_name;
 
       doc.add_term(id_term);
 
-      indexer.index_text(pm->i_from, 1, "F");
-      indexer.index_text(pm->i_to, 1, "T");
+      if (pm->i_message_id && std::strlen(pm->i_message_id) < MAX_TERM_LENGTH) {
+        std::string message_id_term = MESSAGE_ID_PREFIX;
+        message_id_term += pm->i_message_id;
+        doc.add_term(message_id_term);
+      }
+
+      add_flag_terms(doc, pm->flags);
+
+      xi->indexer.index_text(pm->i_from, 1, "F");
+      xi->indexer.index_text(pm->i_to, 1, "T");
 
       if (pm->i_attachments)
-        indexer.index_text(pm->i_attachments, 1, "A");
+        xi->indexer.index_text(pm->i_attachments, 1, "A");
 
       if (pm->i_subject)
-        indexer.index_text(pm->i_subject);
+        xi->indexer.index_text(pm->i_subject);
 
       if (pm->i_content)
-        indexer.index_text(pm->i_content);
+        xi->indexer.index_text(pm->i_content);
 
-      database.replace_document(id_term, doc);
-      database.commit();
+      // While migrating, every new document must be numbered past the old ones
+      if (xi->old_layout_lastdocid) {
+        xi->database->delete_document(id_term);
+        xi->database->add_document(doc);
+      } else {
+        xi->database->replace_document(id_term, doc);
+      }
 
     } catch (const Xapian::Error & error) {
-      std::cout << "Exception: " << error.get_msg() << std::endl;
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      return -1;
     }
+
+    xi->pending_documents++;
+    xi->pending_bytes += indexing_message_size(pm);
+
+    if ((xi->flush_documents && xi->pending_documents >= xi->flush_documents) ||
+        (xi->flush_bytes && xi->pending_bytes >= xi->flush_bytes))
+      return xapian_indexer_flush(xi);
+
+    return 0;
+  }
+
+
+  static int xapian_indexer_pending(XapianIndexer *xi) {
+    xi->pending_documents++;
+    if (xi->flush_documents && xi->pending_documents >= xi->flush_documents)
+      return xapian_indexer_flush(xi);
+    return 0;
+  }
+
+
+  int xapian_indexer_foreach_document(XapianIndexer *xi, XapianDocumentFunc func, void *user_data) {
+    try {
+      Xapian::ValueIterator states = xi->database->valuestream_begin(VALUE_FILE_STATE);
+      Xapian::ValueIterator states_end = xi->database->valuestream_end(VALUE_FILE_STATE);
+
+      // Both value streams are ordered by docid, so states are only skipped forward
+      Xapian::ValueIterator paths_end = xi->database->valuestream_end(VALUE_PATH);
+      for (Xapian::ValueIterator paths = xi->database->valuestream_begin(VALUE_PATH); paths != paths_end; ++paths) {
+        Xapian::docid docid = paths.get_docid();
+
+        if (states != states_end)
+          states.skip_to(docid);
+
+        if (states == states_end || states.get_docid() != docid)
+          func(docid, (*paths).c_str(), NULL, user_data);
+        else
+          func(docid, (*paths).c_str(), (*states).c_str(), user_data);
+      }
+      return 0;
+
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      return -1;
+    }
+  }
+
+
+  int xapian_indexer_delete_document(XapianIndexer *xi, unsigned int docid, const char *path) {
+    try {
+      Xapian::Document doc = xi->database->get_document(docid);
+      if (doc.get_value(VALUE_PATH) != path)
+        return 0;
+
+      xi->database->delete_document(docid);
+
+    } catch (const Xapian::DocNotFoundError &) {
+      return 0;
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      return -1;
+    }
+
+    return xapian_indexer_pending(xi);
+  }
+
+
+  int xapian_indexer_relocate_document(XapianIndexer *xi, unsigned int docid, const char *path, const char *file_state, const char *flags) {
+    try {
+      Xapian::Document doc = xi->database->get_document(docid);
+
+      doc.set_data(path);
+      doc.add_value(VALUE_PATH, path);
+
+      if (file_state)
+        doc.add_value(VALUE_FILE_STATE, file_state);
+
+      remove_flag_terms(doc);
+      add_flag_terms(doc, flags);
+
+      xi->database->replace_document(docid, doc);
+
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      return -1;
+    }
+
+    return xapian_indexer_pending(xi);
+  }
+
+
+  int xapian_indexer_layout_current(XapianIndexer *xi) {
+    return xi->old_layout_lastdocid == 0;
+  }
+
+
+  int xapian_indexer_migrate_layout(XapianIndexer *xi) {
+    if (!xi->old_layout_lastdocid)
+      return 0;
+
+    try {
+      // Documents added while migrating are numbered past the old ones
+      std::vector<Xapian::docid> docids;
+      Xapian::PostingIterator posting = xi->database->postlist_begin("");
+      for (; posting != xi->database->postlist_end("") && *posting <= xi->old_layout_lastdocid; ++posting)
+        docids.push_back(*posting);
+
+      for (std::vector<Xapian::docid>::iterator it = docids.begin(); it != docids.end(); ++it)
+        xi->database->delete_document(*it);
+
+      xi->database->set_metadata(INDEX_LAYOUT_KEY, INDEX_LAYOUT);
+      xi->database->commit();
+      xi->pending_documents    = 0;
+      xi->pending_bytes        = 0;
+      xi->old_layout_lastdocid = 0;
+      return 0;
+
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      return -1;
+    }
+  }
+
+
+  void xapian_indexer_close(XapianIndexer *xi) {
+    if (!xi)
+      return;
+
+    xapian_indexer_flush(xi);
+
+    try {
+      xi->database->close();
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+    }
+
+    delete xi->database;
+    delete xi;
+  }
+
+
+  void xapian_index_message(const char *index_path, IndexingMessage *pm) {
+    XapianIndexer *xi = xapian_indexer_open(index_path, 1, 0);
+    if (!xi)
+      return;
+
+    xapian_indexer_add(xi, pm);
+    xapian_indexer_close(xi);
+  }
+
+
+  // Part lookups of a batch go to the same index, which is kept open between them
+  static pthread_mutex_t   structure_db_lock = PTHREAD_MUTEX_INITIALIZER;
+  static Xapian::Database  *structure_db = NULL;
+  static std::string       structure_db_path;
+
+
+  static char *document_structure(Xapian::Database *db, const char *unique_name, const char *file_state) {
+    std::string id_term = "Q";
+    id_term += unique_name;
+
+    Xapian::PostingIterator posting = db->postlist_begin(id_term);
+    if (posting == db->postlist_end(id_term))
+      return NULL;
+
+    Xapian::Document doc = db->get_document(*posting);
+    if (doc.get_value(VALUE_FILE_STATE) != file_state)
+      return NULL;
+
+    std::string structure = doc.get_value(VALUE_STRUCTURE);
+    if (structure.empty())
+      return NULL;
+
+    return strdup(structure.c_str());
+  }
+
+
+  char *xapian_document_structure(const char *index_path, const char *unique_name, const char *file_state) {
+    char *structure = NULL;
+    pthread_mutex_lock(&structure_db_lock);
+
+    try {
+      if (structure_db && structure_db_path == index_path) {
+        // Picks up documents committed since the last lookup
+        structure_db->reopen();
+      } else {
+        delete structure_db;
+        structure_db = NULL;
+        structure_db = new Xapian::Database(index_path);
+        structure_db_path = index_path;
+      }
+
+      structure = document_structure(structure_db, unique_name, file_state);
+
+    } catch (const Xapian::Error & error) {
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
+      delete structure_db;
+      structure_db = NULL;
+    }
+
+    pthread_mutex_unlock(&structure_db_lock);
+    return structure;
   }
 
 
@@ -55,6 +383,8 @@ extern "C" {
       qp.set_stemmer(stemmer);
       qp.set_database(db);
       qp.set_stemming_strategy(Xapian::QueryParser::STEM_SOME);
+      qp.add_boolean_prefix("flag", FLAG_PREFIX);
+      qp.add_boolean_prefix("id", MESSAGE_ID_PREFIX);
 
       unsigned int flags = Xapian::QueryParser::FLAG_BOOLEAN        |
                          Xapian::QueryParser::FLAG_PHRASE           |
@@ -80,7 +410,7 @@ extern "C" {
       std::strcpy(cstr, results.c_str());
       return cstr;
     } catch (const Xapian::Error & error) {
-      std::cout << "Exception: " << error.get_msg() << std::endl;
+      std::cerr << "Exception: " << error.get_msg() << std::endl;
       return NULL;
     }
   }
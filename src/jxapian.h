@@ -1,21 +1,73 @@
 #ifndef __INDEXER_H
 #define __INDEXER_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct IndexingMessage {
   char *path;
+  char *unique_name;     // maildir unique name, identifying the message file across renames
+  char *flags;           // maildir flags, from the info part of the filename
   char *i_message_id;
   char *i_subject;
   char *i_content;
   char *i_from;
   char *i_to;
   char *i_attachments;
+  char *file_state;      // inode, size and mtime of the file when it was parsed
+  char *structure;       // location of every leaf part within the file, if known
 } IndexingMessage;
 
 
+/*
+ * XapianIndexer
+ *
+ * An indexing session around one writable database. Documents are committed
+ * once flush_documents documents or flush_bytes bytes of indexed text are
+ * pending (0 disables the respective threshold), and when the session closes.
+ */
+typedef struct XapianIndexer XapianIndexer;
+
+XapianIndexer *xapian_indexer_open(const char *index_path, unsigned int flush_documents, size_t flush_bytes);
+int xapian_indexer_add(XapianIndexer *indexer, IndexingMessage *pm);
+int xapian_indexer_flush(XapianIndexer *indexer);
+void xapian_indexer_close(XapianIndexer *indexer);
+
+/*
+ * An index written with a previous layout keeps its documents when opened.
+ * Once every message has been added again, migrate_layout deletes the old
+ * documents and marks the index as current.
+ */
+int xapian_indexer_layout_current(XapianIndexer *indexer);
+int xapian_indexer_migrate_layout(XapianIndexer *indexer);
+
+/*
+ * Calls func for every indexed document which recorded the path and state of
+ * its message file. Documents are deleted only while they still refer to the
+ * given path, so a document replaced by another file in the meantime stays.
+ */
+typedef void (*XapianDocumentFunc)(unsigned int docid, const char *path, const char *file_state, void *user_data);
+
+int xapian_indexer_foreach_document(XapianIndexer *indexer, XapianDocumentFunc func, void *user_data);
+int xapian_indexer_delete_document(XapianIndexer *indexer, unsigned int docid, const char *path);
+
+/*
+ * Points an indexed document to the renamed message file, updating its path,
+ * file state and flags without touching the indexed content.
+ */
+int xapian_indexer_relocate_document(XapianIndexer *indexer, unsigned int docid, const char *path, const char *file_state, const char *flags);
+
+/*
+ * Returns the part structure recorded for the message file with the given
+ * unique name, provided the file state still matches; NULL otherwise. The
+ * result is allocated with malloc(). The index stays open for the next
+ * lookup in the same index.
+ */
+char *xapian_document_structure(const char *index_path, const char *unique_name, const char *file_state);
+
 void xapian_index_message(const char *index_path, IndexingMessage *pm);
 char *xapian_search(const char *index_path, const char *query_str, const unsigned int max_results);
 
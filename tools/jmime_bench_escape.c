@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <glib/gprintf.h>
+
+// The kernels are static, so the library is compiled right into the bench
+#include "../src/jmime.c"
+
+/*
+ * Times the regex-based strip and XML escaping, as they were before the
+ * single-pass kernels, against gstr_strip and gstr_append_xml_escaped, and
+ * checks that both produce the same output.
+ */
+
+static gchar *regex_lstrip(const gchar* text) {
+  GRegex *regex = g_regex_new ("\\A\\s+", 0, 0, NULL);
+  gchar *stripped = g_regex_replace_literal(regex, text, -1, 0, "", 0, NULL);
+  g_regex_unref(regex);
+  return stripped;
+}
+
+static gchar *regex_rstrip(const gchar* text) {
+  GRegex *regex = g_regex_new ("\\s+$", 0, 0, NULL);
+  gchar *stripped = g_regex_replace_literal(regex, text, -1, 0, "", 0, NULL);
+  g_regex_unref(regex);
+  return stripped;
+}
+
+static gchar *regex_strip(const gchar *text) {
+  gchar *lstripped = regex_lstrip(text);
+  gchar *stripped = regex_rstrip(lstripped);
+  g_free(lstripped);
+  return stripped;
+}
+
+static GString *regex_replace_all(GString *text, const gchar* old_str, const gchar *new_str) {
+  gchar *escaped_s1 = g_regex_escape_string (old_str, -1);
+  GRegex *regex = g_regex_new (escaped_s1, 0, 0, NULL);
+  gchar *new_string =  g_regex_replace_literal(regex, text->str, -1, 0, new_str, 0, NULL);
+  g_regex_unref(regex);
+  g_free(escaped_s1);
+  g_string_assign(text, new_string);
+  g_free(new_string);
+  return text;
+}
+
+static GString *regex_escape(const gchar *text) {
+  GString *result = g_string_new(text);
+  regex_replace_all(result, "&", "&amp;"); // replacing of & must come first
+  regex_replace_all(result, "<", "&lt;");
+  regex_replace_all(result, ">", "&gt;");
+  return result;
+}
+
+
+// Text nodes of a typical newsletter: mostly plain text, some entities
+static GPtrArray *sample_texts(guint count) {
+  static const gchar *words[] = { "Newsletter", "offers", "&", "more", "<b>", "prices", "5 > 3", "  ", "\n\t" };
+  GPtrArray *texts = g_ptr_array_new_with_free_func(g_free);
+  GRand *rand = g_rand_new_with_seed(42);
+
+  guint i, j;
+  for (i = 0; i < count; i++) {
+    GString *text = g_string_new("  ");
+    guint n_words = g_rand_int_range(rand, 1, 200);
+    for (j = 0; j < n_words; j++) {
+      g_string_append(text, words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))]);
+      g_string_append_c(text, ' ');
+    }
+    g_ptr_array_add(texts, g_string_free(text, FALSE));
+  }
+
+  g_rand_free(rand);
+  return texts;
+}
+
+
+int main(int argc, char *argv[]) {
+  guint count = argc > 1 ? (guint) atoi(argv[1]) : 20000;
+  if (!count) {
+    g_printerr ("usage: %s [text-count]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  jmime_init();
+
+  GPtrArray *texts = sample_texts(count);
+  GPtrArray *expected = g_ptr_array_new_with_free_func(g_free);
+  GTimer *timer = g_timer_new();
+  guint i;
+
+  g_timer_start(timer);
+  for (i = 0; i < texts->len; i++) {
+    gchar *stripped = regex_strip(g_ptr_array_index(texts, i));
+    GString *escaped = regex_escape(stripped);
+    g_ptr_array_add(expected, g_string_free(escaped, FALSE));
+    g_free(stripped);
+  }
+  gdouble regex_seconds = g_timer_elapsed(timer, NULL);
+
+  GString *output = g_string_new(NULL);
+  guint mismatches = 0;
+
+  g_timer_start(timer);
+  for (i = 0; i < texts->len; i++) {
+    GString *stripped = gstr_strip(g_string_new(g_ptr_array_index(texts, i)));
+    g_string_truncate(output, 0);
+    gstr_append_xml_escaped(output, stripped->str, stripped->len, '\0');
+    g_string_free(stripped, TRUE);
+
+    if (strcmp(output->str, g_ptr_array_index(expected, i)))
+      mismatches++;
+  }
+  gdouble kernel_seconds = g_timer_elapsed(timer, NULL);
+
+  g_printf("texts:    %u (%s span kernel)\n", count, span_use_avx2 ? "AVX2" : "SSE2/scalar");
+  g_printf("regex:    %.3f s\n", regex_seconds);
+  g_printf("kernels:  %.3f s (%.1fx)\n", kernel_seconds, kernel_seconds > 0 ? regex_seconds / kernel_seconds : 0.0);
+  g_printf("mismatch: %u\n", mismatches);
+
+  g_string_free(output, TRUE);
+  g_timer_destroy(timer);
+  g_ptr_array_free(expected, TRUE);
+  g_ptr_array_free(texts, TRUE);
+  jmime_shutdown();
+
+  return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
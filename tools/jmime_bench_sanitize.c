@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <glib/gprintf.h>
+
+// The sanitizer is static, so the library is compiled right into the bench
+#include "../src/jmime.c"
+
+/*
+ * Times sanitize and textize on HTML nested to increasing depths, like the
+ * table-heavy layout of newsletters. Both write into one output buffer, so
+ * the time per level should stay flat as the depth doubles.
+ */
+
+#define BENCH_ROUNDS 20
+
+
+static GString *nested_html(guint depth) {
+  GString *html = g_string_new("<!DOCTYPE html><html><body>");
+
+  guint i;
+  for (i = 0; i < depth; i++)
+    g_string_append(html, "<div class=\"row\"><span>Offers &amp; prices</span> for this week ");
+
+  for (i = 0; i < depth; i++)
+    g_string_append(html, "</div>");
+
+  g_string_append(html, "</body></html>");
+  return html;
+}
+
+
+// The depth the parser actually built, following the last child of each element
+static guint tree_depth(const GumboNode *node) {
+  guint depth = 0;
+  while (node->type == GUMBO_NODE_ELEMENT && node->v.element.children.length) {
+    const GumboVector *children = &node->v.element.children;
+    node = (const GumboNode *) children->data[children->length - 1];
+    depth++;
+  }
+  return depth;
+}
+
+
+int main(int argc, char *argv[]) {
+  const gchar *depth_list = argc > 1 ? argv[1] : "1000,2000,4000";
+  gchar **depths = g_strsplit(depth_list, ",", -1);
+
+  jmime_init();
+
+  GTimer *timer = g_timer_new();
+  SanitizerContext ctx = { NULL, NULL, NULL };
+  gdouble first_per_level = 0;
+  int status = EXIT_SUCCESS;
+
+  g_printf("%8s %8s %12s %12s %14s\n", "depth", "built", "sanitize", "textize", "us/level");
+
+  guint i;
+  for (i = 0; depths[i]; i++) {
+    guint depth = (guint) atoi(depths[i]);
+    if (!depth) {
+      g_printerr ("usage: %s [depth,depth,...]\n", argv[0]);
+      status = EXIT_FAILURE;
+      break;
+    }
+
+    GString *html = nested_html(depth);
+    GumboOutput *output = gumbo_parse_with_options(&kGumboDefaultOptions, html->str, html->len);
+    GString *sanitized = g_string_sized_new(html->len);
+
+    guint round;
+    g_timer_start(timer);
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+      g_string_truncate(sanitized, 0);
+      sanitize(output->document, &ctx, sanitized);
+    }
+    gdouble sanitize_seconds = g_timer_elapsed(timer, NULL) / BENCH_ROUNDS;
+
+    g_timer_start(timer);
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+      GString *text = textize(output->root, 0, NULL);
+      g_string_free(text, TRUE);
+    }
+    gdouble textize_seconds = g_timer_elapsed(timer, NULL) / BENCH_ROUNDS;
+
+    guint built = tree_depth(output->root);
+    gdouble per_level = built ? (sanitize_seconds + textize_seconds) * 1e6 / built : 0;
+    if (!first_per_level)
+      first_per_level = per_level;
+
+    g_printf("%8u %8u %10.3f ms %10.3f ms %8.3f (%.2fx)\n", depth, built,
+             sanitize_seconds * 1e3, textize_seconds * 1e3,
+             per_level, first_per_level > 0 ? per_level / first_per_level : 0.0);
+
+    g_string_free(sanitized, TRUE);
+    gumbo_destroy_output(&kGumboDefaultOptions, output);
+    g_string_free(html, TRUE);
+  }
+
+  g_timer_destroy(timer);
+  g_strfreev(depths);
+  jmime_shutdown();
+
+  return status;
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <glib/gprintf.h>
+
+// The converters are static, so the library is compiled right into the check
+#include "../src/jmime.c"
+
+/*
+ * Converts the plain text bodies of the given messages, or of those in
+ * test/fixtures, both with plain_html_convert and with Gumbo, sanitize and
+ * textize, and checks that the sanitized content, the preview and the
+ * indexed text come out the same.
+ */
+
+#define FIXTURES_DIRECTORY "test/fixtures"
+
+
+static gboolean check_output(const gchar *path, const gchar *what, GString *plain, GString *gumbo) {
+  if (g_string_equal(plain, gumbo))
+    return TRUE;
+
+  g_printerr("%s: %s differs\n  plain: %s\n  gumbo: %s\n", path, what, plain->str, gumbo->str);
+  return FALSE;
+}
+
+
+// Returns FALSE on a mismatch; bodies left to Gumbo anyway count as matching
+static gboolean check_plain_body(const gchar *path, CollectedPart *body_part, guint *checked, guint *fallbacks) {
+  const gchar *filtered = (const gchar *) body_part->content->data;
+  gsize len = body_part->content->len;
+  SanitizerContext ctx = { NULL, NULL, NULL };
+
+  GString *plain_html = g_string_new(NULL);
+  GString *plain_preview = g_string_new(NULL);
+  GString *plain_text = g_string_new(NULL);
+
+  if (!plain_html_convert(filtered, len, &ctx, plain_html, plain_preview, MAX_PREVIEW_LENGTH) ||
+      !plain_html_convert(filtered, len, &ctx, NULL, plain_text, 0)) {
+    g_printf("%s: partId %u is left to Gumbo\n", path, body_part->part_id);
+    g_string_free(plain_html, TRUE);
+    g_string_free(plain_preview, TRUE);
+    g_string_free(plain_text, TRUE);
+    (*fallbacks)++;
+    return TRUE;
+  }
+  gstr_truncate_utf8(plain_preview, MAX_PREVIEW_LENGTH);
+
+  GumboOutput *output = gumbo_parse_with_options(&kGumboDefaultOptions, filtered, len);
+  GString *gumbo_html = g_string_sized_new(len);
+  sanitize(output->document, &ctx, gumbo_html);
+  GString *gumbo_preview = textize(output->root, MAX_PREVIEW_LENGTH, NULL);
+  GString *gumbo_text = textize(output->root, 0, NULL);
+  gumbo_destroy_output(&kGumboDefaultOptions, output);
+
+  // Every output is compared, to report all differences at once
+  gboolean matches = check_output(path, "content", plain_html, gumbo_html);
+  matches = check_output(path, "preview", plain_preview, gumbo_preview) && matches;
+  matches = check_output(path, "indexed text", plain_text, gumbo_text) && matches;
+  (*checked)++;
+
+  g_string_free(gumbo_text, TRUE);
+  g_string_free(gumbo_preview, TRUE);
+  g_string_free(gumbo_html, TRUE);
+  g_string_free(plain_text, TRUE);
+  g_string_free(plain_preview, TRUE);
+  g_string_free(plain_html, TRUE);
+
+  return matches;
+}
+
+
+static gboolean check_message(const gchar *path, guint *checked, guint *fallbacks) {
+  GMimeMessage *message = gmime_message_from_path(path);
+  if (!message)
+    return TRUE;
+
+  PartCollectorData *pc = collect_parts(message, FALSE, 0, NULL);
+  gboolean matches = TRUE;
+
+  CollectedPart *bodies[] = { pc->text_part, pc->html_part };
+  guint i;
+  for (i = 0; i < G_N_ELEMENTS(bodies); i++)
+    if (bodies[i] && bodies[i]->content && g_str_has_prefix(bodies[i]->content_type, "text/plain"))
+      matches = check_plain_body(path, bodies[i], checked, fallbacks) && matches;
+
+  free_part_collector_data(pc);
+  g_object_unref(message);
+  return matches;
+}
+
+
+static GPtrArray *fixture_paths(void) {
+  GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+
+  GDir *dir = g_dir_open(FIXTURES_DIRECTORY, 0, NULL);
+  if (!dir)
+    return paths;
+
+  const gchar *name;
+  while ((name = g_dir_read_name(dir)))
+    g_ptr_array_add(paths, g_build_filename(FIXTURES_DIRECTORY, name, NULL));
+
+  g_dir_close(dir);
+  return paths;
+}
+
+
+int main(int argc, char *argv[]) {
+  GPtrArray *paths;
+
+  if (argc > 1) {
+    paths = g_ptr_array_new_with_free_func(g_free);
+
+    int i;
+    for (i = 1; i < argc; i++)
+      g_ptr_array_add(paths, g_strdup(argv[i]));
+  } else {
+    paths = fixture_paths();
+  }
+
+  if (!paths->len) {
+    g_printerr ("usage: %s [message_file...]\n", argv[0]);
+    g_printerr ("       without arguments, the messages in %s are checked\n", FIXTURES_DIRECTORY);
+    g_ptr_array_free(paths, TRUE);
+    exit(EXIT_FAILURE);
+  }
+
+  jmime_init();
+
+  guint checked = 0, fallbacks = 0, mismatches = 0;
+  guint i;
+  for (i = 0; i < paths->len; i++)
+    if (!check_message(g_ptr_array_index(paths, i), &checked, &fallbacks))
+      mismatches++;
+
+  g_printf("messages: %u\n", paths->len);
+  g_printf("bodies:   %u (%u left to Gumbo)\n", checked, fallbacks);
+  g_printf("mismatch: %u\n", mismatches);
+
+  g_ptr_array_free(paths, TRUE);
+  jmime_shutdown();
+
+  return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
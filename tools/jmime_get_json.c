@@ -1,38 +1,87 @@
 #include <stdlib.h>
+#include <unistd.h>
 #include <glib/gprintf.h>
 #include "../src/jmime.h"
 
+// Messages are streamed to stdout as they are converted; envelopes are small
+static gboolean write_json(gchar *path, gboolean envelope, const JMimeJsonOptions *options) {
+  if (!envelope)
+    return jmime_write_json(path, options, STDOUT_FILENO) >= 0;
+
+  GString *json_message = jmime_get_envelope_with_options(path, options);
+  if (!json_message)
+    return FALSE;
+
+  fwrite(json_message->str, 1, json_message->len, stdout);
+  g_string_free(json_message, TRUE);
+  return TRUE;
+}
+
+static gboolean envelope         = FALSE;
+static gchar    *cid_url_template = NULL;
+static gchar    *fields           = NULL;
+static gboolean no_cache          = FALSE;
+static gboolean cbor              = FALSE;
+
+static GOptionEntry entries[] = {
+  { "envelope", 0, 0, G_OPTION_ARG_NONE,   &envelope,         "Read only the headers, as needed for message listings", NULL },
+  { "cid-url",  0, 0, G_OPTION_ARG_STRING, &cid_url_template, "Reference inline images by URL, like /parts/{partId}", "TEMPLATE" },
+  { "fields",   0, 0, G_OPTION_ARG_STRING, &fields,           "Convert only the given members, like subject,text.preview", "LIST" },
+  { "no-cache", 0, 0, G_OPTION_ARG_NONE,   &no_cache,         "Neither read nor write the conversion cache of the mailbox", NULL },
+  { "cbor",     0, 0, G_OPTION_ARG_NONE,   &cbor,             "Write a sequence of CBOR items instead of JSON", NULL },
+  { NULL }
+};
+
 int main(int argc, char *argv[]) {
+  GError *error = NULL;
+  GOptionContext *context = g_option_context_new("<MIME-Message-path>...");
+  g_option_context_add_main_entries(context, entries, NULL);
+
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    exit(EXIT_FAILURE);
+  }
+  g_option_context_free(context);
 
   if (argc < 2) {
-    g_printerr ("usage: %s <MIME-Message-path>\n", argv[0]);
+    g_printerr ("usage: %s [--envelope] [--cid-url=<template>] [--fields=<list>] [--no-cache] [--cbor] <MIME-Message-path>...\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  jmime_init();
-  if (argc == 2) {
+  JMimeJsonOptions options;
+  jmime_json_options_init(&options);
 
-  GString *json_message = NULL;
-  json_message = jmime_get_json(argv[1], TRUE);
-  if (!json_message)
-    exit(EXIT_FAILURE);
+  options.cid_url_template = cid_url_template;
+  options.fields           = fields;
+  options.use_cache        = !no_cache;
+
+  if (cbor)
+    options.format = JMIME_FORMAT_CBOR;
+
+  int first = 1;
 
+  jmime_init();
   setbuf(stdout, NULL);
-  g_printf("%s\n", json_message->str);
-  g_string_free(json_message, TRUE);
+
+  if (options.format == JMIME_FORMAT_CBOR) {
+    int x;
+    for ( x = first; x < argc; x++ ) {
+      if (!write_json(argv[x], envelope, &options))
+        exit(EXIT_FAILURE);
+    }
+
+  } else if (argc == first + 1) {
+    if (!write_json(argv[first], envelope, &options))
+      exit(EXIT_FAILURE);
+    g_printf("\n");
+
   } else {
     g_printf("[");
     int x;
-    for ( x = 1; x < argc; x++ ) {
-      /* printf("File: %s\n", argv[x]); */
-      GString *json_message = NULL;
-      json_message = jmime_get_json(argv[x], TRUE);
-      if (!json_message)
+    for ( x = first; x < argc; x++ ) {
+      if (!write_json(argv[x], envelope, &options))
         exit(EXIT_FAILURE);
-
-      setbuf(stdout, NULL);
-      g_printf("%s,", json_message->str);
-      g_string_free(json_message, TRUE);
+      g_printf(",");
     }
     g_printf("]\n");
   }
@@ -1,16 +1,79 @@
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <glib/gprintf.h>
 #include "../src/jmime.h"
 
+
+/*
+ * Parses a list of partIds like "1,3,5" into an array, NULL if any of them
+ * cannot be parsed.
+ */
+static GArray *parse_part_ids(const gchar *list) {
+  GArray *part_ids = g_array_new(FALSE, FALSE, sizeof(guint));
+  gchar **items = g_strsplit(list, ",", -1);
+
+  guint i;
+  for (i = 0; items[i]; i++) {
+    gchar *end = NULL;
+    guint part_id = g_ascii_strtoull(items[i], &end, 10);
+
+    if (end == items[i] || *end) {
+      g_array_free(part_ids, TRUE);
+      part_ids = NULL;
+      break;
+    }
+    g_array_append_val(part_ids, part_id);
+  }
+
+  g_strfreev(items);
+  return part_ids;
+}
+
+
+static int write_parts(const gchar *message_path, const gchar *list, const gchar *output_dir) {
+  GArray *part_ids = NULL;
+
+  if (strcmp(list, "all")) {
+    part_ids = parse_part_ids(list);
+    if (!part_ids) {
+      g_printerr("part_id list could not be parsed\r\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  gint written = jmime_write_parts((gchar *) message_path,
+                                   part_ids ? (guint *) part_ids->data : NULL,
+                                   part_ids ? part_ids->len : 0,
+                                   output_dir);
+  if (part_ids)
+    g_array_free(part_ids, TRUE);
+
+  if (written < 0)
+    return EXIT_FAILURE;
+
+  g_printf("Written %d parts to directory %s\r\n", written, output_dir);
+  return EXIT_SUCCESS;
+}
+
+
 int main (int argc, char *argv[]) {
 
   if (argc < 4) {
-    g_printerr ("usage: %s message_file part_id out_file\n", argv[0]);
+    g_printerr ("usage: %s message_file part_id out_file|-\n", argv[0]);
+    g_printerr ("       %s message_file all|part_id,part_id,... out_dir\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
   jmime_init();
 
+  // Several parts, or all of them, go into a directory
+  if (!strcmp(argv[2], "all") || strchr(argv[2], ',')) {
+    int status = write_parts(argv[1], argv[2], argv[3]);
+    jmime_shutdown();
+    exit(status);
+  }
 
   int part_id = g_ascii_strtoll(argv[2], NULL, 10);
   if (!part_id) {
@@ -18,21 +81,32 @@ int main (int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  GByteArray *attachment = jmime_get_part(argv[1], part_id);
-  if (!attachment)
+  // "-" streams the decoded part to stdout
+  gboolean to_stdout = g_strcmp0(argv[3], "-") == 0;
+  int fd = to_stdout ? STDOUT_FILENO : open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    g_printerr("file could not be opened for writing: %s\r\n", argv[3]);
     exit(EXIT_FAILURE);
+  }
+
+  gssize written = jmime_write_part(argv[1], part_id, fd);
+  if (!to_stdout && close(fd) < 0 && written >= 0)
+    written = -2;
 
-  FILE *fout = fopen(argv[4], "wb");
-  if (!fout) {
-    g_printerr("file could not be opened for writing: %s\r\n", argv[4]);
+  if (written == -2)
+    g_printerr("part could not be written to %s\r\n", to_stdout ? "stdout" : argv[3]);
+
+  // No truncated file is left behind, whatever went wrong
+  if (written < 0) {
+    if (!to_stdout)
+      unlink(argv[3]);
     exit(EXIT_FAILURE);
   }
 
-  g_printf("Written %d bytes to file %s\r\n", attachment->len, argv[4]);
-  fwrite(attachment->data, attachment->len, 1, fout);
-  fclose(fout);
-
-  g_byte_array_free(attachment, TRUE);
+  if (to_stdout)
+    g_printerr("Written %zd bytes to stdout\r\n", written);
+  else
+    g_printf("Written %zd bytes to file %s\r\n", written, argv[3]);
 
   jmime_shutdown();
 
@@ -2,15 +2,51 @@
 #include <glib/gprintf.h>
 #include "../src/jmime.h"
 
+static gint     commit_documents = -1;
+static gint64   commit_bytes     = -1;
+static gint     jobs             = -1;
+static gboolean full             = FALSE;
+
+static GOptionEntry entries[] = {
+  { "commit-documents", 0, 0, G_OPTION_ARG_INT,   &commit_documents, "Commit the index after N documents (0: no limit)", "N" },
+  { "commit-bytes",     0, 0, G_OPTION_ARG_INT64, &commit_bytes,     "Commit the index after N bytes of indexed text (0: no limit)", "N" },
+  { "jobs",           'j', 0, G_OPTION_ARG_INT,   &jobs,             "Parse messages on N worker threads", "N" },
+  { "full",             0, 0, G_OPTION_ARG_NONE,  &full,             "Reindex unchanged messages too", NULL },
+  { NULL }
+};
+
 int main(int argc, char *argv[]) {
+  GError *error = NULL;
+  GOptionContext *context = g_option_context_new("<Mailbox-Path>");
+  g_option_context_add_main_entries(context, entries, NULL);
+
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    exit(EXIT_FAILURE);
+  }
+  g_option_context_free(context);
 
   if (argc < 2) {
-    g_printerr ("usage: %s <Mailbox-Path>\n", argv[0]);
+    g_printerr ("usage: %s [--commit-documents=N] [--commit-bytes=N] [--jobs=N] [--full] <Mailbox-Path>\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
+  JMimeIndexOptions options;
+  jmime_index_options_init(&options);
+
+  if (commit_documents >= 0)
+    options.commit_documents = commit_documents;
+
+  if (commit_bytes >= 0)
+    options.commit_bytes = commit_bytes;
+
+  if (jobs > 0)
+    options.jobs = jobs;
+
+  options.full = full;
+
   jmime_init();
-  jmime_index_mailbox(argv[1]);
+  jmime_index_mailbox_with_options(argv[1], &options);
   jmime_shutdown();
 
   return 0;
@@ -5,12 +5,22 @@
 int main(int argc, char *argv[]) {
 
   if (argc < 3) {
-    g_printerr ("usage: %s <Index-Path> <Mailbox-Path>\n", argv[0]);
+    g_printerr ("usage: %s <Index-Path> <Message-Path>...\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
   jmime_init();
-  jmime_index_message(argv[1], argv[2]);
+
+  // All messages given are indexed within one session, committed together
+  JMimeIndexer *indexer = jmime_indexer_open(argv[1], NULL);
+  if (!indexer)
+    exit(EXIT_FAILURE);
+
+  int x;
+  for (x = 2; x < argc; x++)
+    jmime_indexer_add(indexer, argv[x]);
+
+  jmime_indexer_close(indexer);
   jmime_shutdown();
 
   return 0;